@@ -0,0 +1,150 @@
+/**
+ * BufferedPrint.h
+ *
+ * Print adapter that collects small writes in a fixed buffer and forwards
+ * them to the underlying Print (usually a network client) in large blocks.
+ * Optionally frames its output with HTTP/1.1 chunked transfer encoding.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+// Sized to one TCP segment: the Ethernet MSS with LARGE_JSON_BUFFERS, or the
+// minimum MSS every host has to accept otherwise.
+#ifndef RESPONSE_BUFFER_SIZE
+#ifdef LARGE_JSON_BUFFERS
+#define RESPONSE_BUFFER_SIZE 1460
+#else
+#define RESPONSE_BUFFER_SIZE 536
+#endif
+#endif
+
+class BufferedPrint : public Print {
+public:
+  BufferedPrint(Print &out_) : out(&out_) {}
+
+  /**
+   * Redirects further output. Anything still buffered should be flushed to
+   * the previous target first.
+   */
+  void setOutput(Print &out_) { out = &out_; }
+
+  size_t write(uint8_t c) {
+    if (length >= capacity()) {
+      flush();
+    }
+    buffer[length++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t *data, size_t size) {
+    // Nothing to coalesce with, so hand full blocks straight through
+    if (!chunked && length == 0 && size >= RESPONSE_BUFFER_SIZE) {
+      return out->write(data, size);
+    }
+
+    size_t remaining = size;
+    while (remaining > 0) {
+      if (length >= capacity()) {
+        flush();
+      }
+      size_t n = capacity() - length;
+      if (n > remaining) {
+        n = remaining;
+      }
+      memcpy(buffer + length, data, n);
+      length += n;
+      data += n;
+      remaining -= n;
+    }
+    return size;
+  }
+
+  /**
+   * Sends everything buffered so far. Must be called before the underlying
+   * connection is closed.
+   */
+  void flush() {
+    if (chunked) {
+      closeChunk();
+    }
+    if (length > 0) {
+      out->write(buffer, length);
+      length = 0;
+    }
+    if (chunked) {
+      openChunk();
+    }
+  }
+
+  /**
+   * Everything written from now on is sent as HTTP/1.1 chunks, one per
+   * flushed buffer. The response headers may still be in the buffer.
+   */
+  void beginChunked() {
+    // Room for the chunk header, a byte of data and the chunk trailer
+    if (RESPONSE_BUFFER_SIZE - CHUNK_TRAILER_SIZE - length <
+        CHUNK_HEADER_SIZE + 1) {
+      flush();
+    }
+    chunked = true;
+    openChunk();
+  }
+
+  /**
+   * Closes the current chunk and queues the terminating zero-length chunk.
+   * Call flush() afterwards.
+   */
+  void endChunked() {
+    closeChunk();
+    chunked = false;
+    print("0\r\n\r\n");
+  }
+
+private:
+  // Chunk sizes are written as four zero-padded hex digits plus CRLF, so the
+  // header can be reserved before the chunk length is known.
+  static const uint8_t CHUNK_HEADER_SIZE = 6;
+  static const uint8_t CHUNK_TRAILER_SIZE = 2;
+
+  Print *out;
+  uint8_t buffer[RESPONSE_BUFFER_SIZE];
+  uint16_t length = 0;
+  uint16_t chunkStart = 0;
+  bool chunked = false;
+
+  uint16_t capacity() const {
+    return chunked ? RESPONSE_BUFFER_SIZE - CHUNK_TRAILER_SIZE
+                   : RESPONSE_BUFFER_SIZE;
+  }
+
+  void openChunk() {
+    chunkStart = length;
+    length += CHUNK_HEADER_SIZE;
+  }
+
+  void closeChunk() {
+    uint16_t size = length - chunkStart - CHUNK_HEADER_SIZE;
+    if (size == 0) {
+      // An empty chunk would terminate the body
+      length = chunkStart;
+      return;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    uint8_t *header = buffer + chunkStart;
+    for (int8_t i = 3; i >= 0; i--) {
+      header[i] = hex[size & 0xf];
+      size >>= 4;
+    }
+    header[4] = '\r';
+    header[5] = '\n';
+    buffer[length++] = '\r';
+    buffer[length++] = '\n';
+  }
+};
@@ -25,6 +25,17 @@
 
 #define ESP_MAX_PUT_BODY_SIZE 512
 
+// Number of property callbacks and action starts that network handlers can
+// defer to update(), which then runs them in loop() context. A power of
+// two; 0 runs them right in the handlers.
+#ifndef ESP_CALLBACK_QUEUE_DEPTH
+#define ESP_CALLBACK_QUEUE_DEPTH 0
+#endif
+
+#if ESP_CALLBACK_QUEUE_DEPTH > 0
+#include "ThingSpscQueue.h"
+#endif
+
 #ifndef LARGE_JSON_DOCUMENT_SIZE
 #ifdef LARGE_JSON_BUFFERS
 #define LARGE_JSON_DOCUMENT_SIZE 4096
@@ -74,12 +85,14 @@ public:
                     std::bind(&WebThingAdapter::handleThings, this,
                               std::placeholders::_1));
 
+    thingFreezeDevices(this->firstDevice);
+
     ThingDevice *device = this->firstDevice;
     while (device != nullptr) {
       String deviceBase = "/things/" + device->id;
 
-      ThingProperty *property = device->firstProperty;
-      while (property != nullptr) {
+      for (uint16_t i = 0; i < device->propertyCount(); i++) {
+        ThingProperty *property = device->property(i);
         String propertyBase = deviceBase + "/properties/" + property->id;
         this->server.on(propertyBase.c_str(), HTTP_GET,
                         std::bind(&WebThingAdapter::handleThingPropertyGet,
@@ -93,12 +106,10 @@ public:
                                   std::placeholders::_1, std::placeholders::_2,
                                   std::placeholders::_3, std::placeholders::_4,
                                   std::placeholders::_5));
-
-        property = (ThingProperty *)property->next;
       }
 
-      ThingAction *action = device->firstAction;
-      while (action != nullptr) {
+      for (uint16_t i = 0; i < device->actionCount(); i++) {
+        ThingAction *action = device->action(i);
         String actionBase = deviceBase + "/actions/" + action->id;
         this->server.on(actionBase.c_str(), HTTP_GET,
                         std::bind(&WebThingAdapter::handleThingActionGet, this,
@@ -115,22 +126,19 @@ public:
                         std::bind(&WebThingAdapter::handleThingActionDelete,
                                   this, std::placeholders::_1, device,
                                   action));
-        action = (ThingAction *)action->next;
       }
 
-      ThingEvent *event = device->firstEvent;
-      while (event != nullptr) {
+      for (uint16_t i = 0; i < device->eventCount(); i++) {
+        ThingEvent *event = device->event(i);
         String eventBase = deviceBase + "/events/" + event->id;
         this->server.on(eventBase.c_str(), HTTP_GET,
                         std::bind(&WebThingAdapter::handleThingEventGet, this,
                                   std::placeholders::_1, device, event));
-        event = (ThingEvent *)event->next;
       }
 
       this->server.on((deviceBase + "/properties").c_str(), HTTP_GET,
                       std::bind(&WebThingAdapter::handleThingPropertiesGet,
-                                this, std::placeholders::_1,
-                                device->firstProperty));
+                                this, std::placeholders::_1, device));
       this->server.on((deviceBase + "/actions").c_str(), HTTP_GET,
                       std::bind(&WebThingAdapter::handleThingActionsGet, this,
                                 std::placeholders::_1, device));
@@ -155,21 +163,99 @@ public:
     this->server.begin();
   }
 
-  void update() {
+  /**
+   * Runs the application and the network half. With a `budget` in
+   * microseconds, stops running deferred callbacks once it is used up and
+   * leaves the network half to the next call.
+   *
+   * Returns the millis() time by which update() has to be called again:
+   * now if work is pending, otherwise the next scheduled function or
+   * background refresh, at most THING_MAX_SLEEP ms ahead.
+   */
+  unsigned long update(unsigned long budget = 0) {
+    unsigned long start = micros();
+    if (!runCallbacks(budget) ||
+        (budget > 0 && micros() - start >= budget)) {
+      return millis();
+    }
+    poll();
+    return nextDeadline();
+  }
+
+  /**
+   * The network half of update(): mDNS and pushing property changes. With
+   * runCallbacks() this lets a ThingNetworkTask run the adapter on a task
+   * of its own.
+   */
+  void poll() {
+    thingApplyValuesFromISR(firstDevice);
 #ifdef ESP8266
     MDNS.update();
 #endif
 #ifndef WITHOUT_WS
     // * Send changed properties as defined in "4.5 propertyStatus message"
-    // Do this by looping over all devices and properties
-    ThingDevice *device = this->firstDevice;
-    while (device != nullptr) {
-      sendChangedProperties(device);
-      device = device->next;
+    // Do this by looping over the changed properties of all devices. Devices
+    // with clients refresh their background properties first.
+    for (ThingDevice *device = this->firstDevice; device != nullptr;
+         device = device->next) {
+      if (((AsyncWebSocket *)device->ws)->count() > 0) {
+        device->refreshProperties();
+      }
+    }
+    if (changes.poll()) {
+      ThingDevice *device = this->firstDevice;
+      while (device != nullptr) {
+        sendChangedProperties(device);
+        device = device->next;
+      }
     }
 #endif
   }
 
+  /**
+   * The application half of update(): runs the functions scheduled with
+   * thingScheduler() and the callbacks deferred by the network handlers,
+   * see ESP_CALLBACK_QUEUE_DEPTH. With a `budget` in microseconds, returns
+   * false if it ran out of time before all callbacks ran.
+   */
+  bool runCallbacks(unsigned long budget = 0) {
+    unsigned long start = micros();
+    thingScheduler().run();
+#if ESP_CALLBACK_QUEUE_DEPTH > 0
+    Callback callback;
+    while (callbacks.pop(callback)) {
+      runCallback(callback);
+      if (budget > 0 && micros() - start >= budget) {
+        return callbacks.empty();
+      }
+    }
+#endif
+    return true;
+  }
+
+  unsigned long nextDeadline() {
+    unsigned long now = millis();
+    if (thingISRPending()) {
+      return now;
+    }
+#if ESP_CALLBACK_QUEUE_DEPTH > 0
+    if (!callbacks.empty()) {
+      return now;
+    }
+#endif
+    unsigned long deadline =
+        thingScheduler().nextDeadline(now + THING_MAX_SLEEP);
+#ifndef WITHOUT_WS
+    for (ThingDevice *device = this->firstDevice; device != nullptr;
+         device = device->next) {
+      if (((AsyncWebSocket *)device->ws)->count() > 0) {
+        deadline = device->refreshDeadline(deadline);
+      }
+    }
+#endif
+    return deadline;
+  }
+
   void addDevice(ThingDevice *device) {
     if (this->lastDevice == nullptr) {
       this->firstDevice = device;
@@ -202,9 +288,54 @@ private:
   bool disableHostValidation;
   ThingDevice *firstDevice = nullptr;
   ThingDevice *lastDevice = nullptr;
+#ifndef WITHOUT_WS
+  ThingChangeCursor changes;
+#endif
   char body_data[ESP_MAX_PUT_BODY_SIZE];
   bool b_has_body_data = false;
 
+  // Work a network handler leaves for loop(): either a property whose
+  // callback has to run or an action to start. Actions are referred to by
+  // id, as their address may be reused after they are removed.
+  struct Callback {
+    ThingDevice *device;
+    ThingProperty *property;
+    // ThingActionObject ids have 16 characters
+    char actionId[17];
+  };
+
+#if ESP_CALLBACK_QUEUE_DEPTH > 0
+  // Filled by the network task, drained by update()
+  ThingSpscQueue<Callback, ESP_CALLBACK_QUEUE_DEPTH> callbacks;
+#endif
+
+  // Runs the callback in loop() context if there is room in the queue,
+  // otherwise right away
+  void deferCallback(ThingDevice *device, ThingProperty *property,
+                     ThingActionObject *action) {
+    Callback callback = {device, property, {0}};
+    if (action != nullptr) {
+      strncpy(callback.actionId, action->id.c_str(),
+              sizeof(callback.actionId) - 1);
+    }
+#if ESP_CALLBACK_QUEUE_DEPTH > 0
+    if (callbacks.push(callback)) {
+      return;
+    }
+#endif
+    runCallback(callback);
+  }
+
+  void runCallback(const Callback &callback) {
+    if (callback.property != nullptr) {
+      callback.property->changed(callback.property->getValue());
+      return;
+    }
+
+    // Does nothing if the action was removed while it was waiting
+    callback.device->startActionObject(callback.actionId);
+  }
+
   bool verifyHost(AsyncWebServerRequest *request) {
     if (disableHostValidation) {
       return true;
@@ -272,7 +403,7 @@ private:
       return;
     }
 
-    String messageType = newProp["messageType"].as<String>();
+    const char *messageType = newProp["messageType"] | "";
     JsonVariant dataVariant = newProp["data"];
     if (!dataVariant.is<JsonObject>()) {
       sendErrorMsg(newProp, *client, 400, "data must be an object");
@@ -281,11 +412,18 @@ private:
 
     JsonObject data = dataVariant.as<JsonObject>();
 
-    if (messageType == "setProperty") {
+    switch (thingHash(messageType)) {
+    case thingHash("setProperty"):
       for (JsonPair kv : data) {
-        device->setProperty(kv.key().c_str(), kv.value());
+        ThingProperty *property =
+            device->storeProperty(kv.key().c_str(), kv.value());
+        if (property != nullptr) {
+          deferCallback(device, property, nullptr);
+        }
       }
-    } else if (messageType == "requestAction") {
+      break;
+
+    case thingHash("requestAction"):
       for (JsonPair kv : data) {
         DynamicJsonDocument *actionRequest =
             new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
@@ -303,40 +441,42 @@ private:
                                            device, std::placeholders::_1));
           device->sendActionStatus(obj);
 
-          obj->start();
+          deferCallback(device, nullptr, obj);
         }
       }
-    } else if (messageType == "addEventSubscription") {
+      break;
+
+    case thingHash("addEventSubscription"):
       for (JsonPair kv : data) {
         ThingEvent *event = device->findEvent(kv.key().c_str());
         if (event) {
           device->addEventSubscription(client->id(), event->id);
         }
       }
+      break;
+
+    default:
+      break;
     }
   }
 
   void sendChangedProperties(ThingDevice *device) {
+    ThingItem *item = changes.first(device);
+    if (item == nullptr) {
+      return;
+    }
     // Prepare one buffer per device
     DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
     message["messageType"] = "propertyStatus";
     JsonObject prop = message.createNestedObject("data");
-    bool dataToSend = false;
-    ThingItem *item = device->firstProperty;
     while (item != nullptr) {
-      ThingDataValue *value = item->changedValueOrNull();
-      if (value) {
-        dataToSend = true;
-        item->serializeValue(prop);
-      }
-      item = item->next;
-    }
-    if (dataToSend) {
-      String jsonStr;
-      serializeJson(message, jsonStr);
-      // Inform all connected ws clients of a Thing about changed properties
-      ((AsyncWebSocket *)device->ws)->textAll(jsonStr);
+      item->serializeValue(prop);
+      item = changes.next(item);
     }
+    String jsonStr;
+    serializeJson(message, jsonStr);
+    // Inform all connected ws clients of a Thing about changed properties
+    ((AsyncWebSocket *)device->ws)->textAll(jsonStr);
   }
 #endif
 
@@ -530,7 +670,7 @@ private:
     b_has_body_data = false;
     memset(body_data, 0, sizeof(body_data));
 
-    obj->start();
+    deferCallback(device, nullptr, obj);
   }
 
   void handleThingEventGet(AsyncWebServerRequest *request, ThingDevice *device,
@@ -549,7 +689,7 @@ private:
   }
 
   void handleThingPropertiesGet(AsyncWebServerRequest *request,
-                                ThingItem *rootItem) {
+                                ThingDevice *device) {
     if (!verifyHost(request)) {
       return;
     }
@@ -558,11 +698,7 @@ private:
 
     DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
     JsonObject prop = doc.to<JsonObject>();
-    ThingItem *item = rootItem;
-    while (item != nullptr) {
-      item->serializeValue(prop);
-      item = item->next;
-    }
+    device->serializeValues(prop);
     serializeJson(prop, *response);
     request->send(response);
   }
@@ -641,7 +777,7 @@ private:
     b_has_body_data = false;
     memset(body_data, 0, sizeof(body_data));
 
-    obj->start();
+    deferCallback(device, nullptr, obj);
   }
 
   void handleThingEventsGet(AsyncWebServerRequest *request,
@@ -697,7 +833,9 @@ private:
       return;
     }
 
-    device->setProperty(property->id.c_str(), newProp[property->id]);
+    if (device->storeProperty(property->id.c_str(), newProp[property->id])) {
+      deferCallback(device, property, nullptr);
+    }
 
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
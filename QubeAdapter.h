@@ -7,11 +7,49 @@
 #include <ArduinoJson.h>
 #include <ESPAsyncWebServer.h>
 #include "Thing.h"
+#include "QubeOutbox.h"
 #include <WebSocketsClient.h>
 
 #define QA_LOG(...) Serial.printf(__VA_ARGS__)
 #define ESP_MAX_PUT_BODY_SIZE 512
 
+// Initial size of the buffer outgoing messages are serialized into. It grows
+// to fit the largest message sent.
+#ifndef QUBE_FRAME_BUFFER_SIZE
+#define QUBE_FRAME_BUFFER_SIZE LARGE_JSON_DOCUMENT_SIZE
+#endif
+
+// Number of messages collected into one batch frame; a full queue is sent
+// before update() ends
+#ifndef QUBE_SEND_QUEUE_DEPTH
+#define QUBE_SEND_QUEUE_DEPTH 16
+#endif
+
+#define QUBE_BATCH_PREFIX "{\"messageType\":\"batch\",\"data\":["
+
+// What to drop when the send queue is full
+enum QubeDropPolicy { QUBE_DROP_OLDEST, QUBE_DROP_NEWEST };
+
+// Bounds of the reconnect delay, which doubles after every failed attempt
+#ifndef QUBE_RECONNECT_MIN
+#define QUBE_RECONNECT_MIN 1000
+#endif
+
+#ifndef QUBE_RECONNECT_MAX
+#define QUBE_RECONNECT_MAX 60000
+#endif
+
+// Time to wait for StartWsAck before the server is taken to be one that
+// does not know the handshake
+#ifndef QUBE_HANDSHAKE_TIMEOUT
+#define QUBE_HANDSHAKE_TIMEOUT 2000
+#endif
+
+// Capacity of the message type table, built-in types included
+#ifndef QUBE_MAX_MESSAGE_TYPES
+#define QUBE_MAX_MESSAGE_TYPES 16
+#endif
+
 #ifndef LARGE_JSON_DOCUMENT_SIZE
 #ifdef LARGE_JSON_BUFFERS
 #define LARGE_JSON_DOCUMENT_SIZE 4096
@@ -34,8 +72,52 @@ class QubeAdapter {
     QubeAdapter(String _name, IPAddress _ip, uint16_t _port = 80,
                   bool _disableHostValidation = false)
       : name(_name), ip(_ip.toString()), port(_port),
-        disableHostValidation(_disableHostValidation) {}
-    
+        disableHostValidation(_disableHostValidation) {
+        onMessage("getProperty", [this](JsonVariantConst message) {
+            handleThingPropertiesGet(message["thingId"] | "");
+        });
+        onMessage("setProperty", [this](JsonVariantConst message) {
+            JsonVariantConst data = message["data"];
+            handleThingPropertyPut(message["thingId"] | "",
+                                   data["propertyId"] | "", data);
+        });
+        onMessage("getThingDescription", [this](JsonVariantConst message) {
+            handleThing(message["thingId"] | "");
+        });
+        onMessage("getAllThings", [this](JsonVariantConst message) {
+            handleThings();
+        });
+        onMessage("performAction", [this](JsonVariantConst message) {
+            handleThingActionPost(message["thingId"] | "", message["data"]);
+        });
+        onMessage("StartWsAck", [this](JsonVariantConst message) {
+            // Messages queued so far are in the old format
+            flushSendQueue();
+            peerBatching = message["batch"] | false;
+            peerMsgPack = messagePack && (message["msgpack"] | false);
+            peerAcks = message["ack"] | false;
+            startAcked = true;
+        });
+        onMessage("ack", [this](JsonVariantConst message) {
+            outbox.ack(message["seq"] | 0UL);
+        });
+        onMessage("propertyAck", [this](JsonVariantConst message) {
+            uint32_t version = message["version"] | 0UL;
+            // A round counts as synced once all of its messages are
+            // acknowledged; acks of earlier rounds are ignored
+            if (version == roundVersion && roundUnacked > 0 &&
+                --roundUnacked == 0) {
+                syncedVersion = roundVersion;
+            }
+        });
+    }
+
+    ~QubeAdapter() {
+        free(frameBuffer);
+    }
+
+    typedef std::function<void(JsonVariantConst message)> MessageHandler;
+
     String name;
     String ip;
     uint16_t port;
@@ -45,80 +127,177 @@ class QubeAdapter {
     char body_data[ESP_MAX_PUT_BODY_SIZE];
     bool b_has_body_data = false;
     WebSocketsClient webSocket;
+    // Events (and other messages sent with sendReliable()) until the tunnel
+    // server acknowledges them
+    QubeOutbox outbox;
 
     WebSocketsClient getWebSocketClient() {
         return webSocket;
     }
 
-    void sendMessage(String & msg) {
-        webSocket.sendTXT(msg.c_str(), msg.length() + 1);
+    /**
+     * Offers MessagePack instead of JSON in the StartWs handshake of the
+     * next connection. Once the tunnel server accepts it, all messages in
+     * both directions are sent as MessagePack in binary frames.
+     */
+    void setMessagePack(bool enabled) {
+        messagePack = enabled;
     }
 
+    void sendMessage(String & msg) {
+        flushSendQueue();
+        webSocket.sendTXT(msg.c_str(), msg.length());
+    }
 
-    void messageHandler(String payload){
-        
-        DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
-        DeserializationError error = deserializeJson(doc, payload);
-        if (error) {
-            QA_LOG("[QA:messageHandler] deserializeJson() failed: %s\n", error.c_str());
-            String msg = "{\"messageType\":\"error\", \"errorMessage\":\"deserializeJson() failed \"}";
-            sendMessage(msg);
+    /**
+     * Sends `doc`. Once the tunnel server has agreed to batching, messages
+     * are queued and sent together by update().
+     */
+    void sendDocument(JsonDocument &doc) {
+        if (peerBatching) {
+            queueDocument(doc);
+        } else {
+            sendFrame(doc);
         }
+    }
 
-        JsonObject root = doc.as<JsonObject>();
-
-        if (root["messageType"] == "getProperty") {
-            QA_LOG("[QA:messageHandler] Received a 'getProperty' message\n");
-            String thingId = root["thingId"];
-            handleThingPropertiesGet(thingId);
+    /**
+     * Sends `doc` with a sequence number. While the tunnel is down, and
+     * until the handshake of the next connection is done, it is only stored
+     * in the outbox and sent after the handshake. If the tunnel server
+     * accepted acks in the handshake, it is kept until it is acknowledged
+     * with an ack message and replayed after every reconnect until then.
+     */
+    void sendReliable(JsonDocument &doc) {
+        bool connected = webSocket.isConnected();
+        if (!connected || replayPending || peerAcks) {
+            outbox.push(doc);
         }
-
-        else if (root["messageType"] == "setProperty") {
-            String thingId = root["thingId"];
-            String propertyId = root["data"]["propertyId"];
-            QA_LOG("[QA:messageHandler] Received a 'setProperty' message\n");
-            String data  = root["data"];
-            handleThingPropertyPut(thingId, propertyId, data);
+        // Pending replays include the message already
+        if (connected && !replayPending) {
+            sendDocument(doc);
         }
+    }
 
-        else if (root["messageType"] == "getThingDescription") {
-            QA_LOG("[QA:messageHandler] Received a 'getThingDescription' message\n");
-            String thingId = root["thingId"];
-            handleThing(thingId);
+    // Sends everything queued: a single message as is, several wrapped into
+    // one batch message. Returns false if the socket did not take it, in
+    // which case the messages stay queued.
+    bool flushSendQueue() {
+        if (queued == 0) {
+            return true;
+        }
+        bool sent;
+        if (queued == 1) {
+            sent = sendPayload(frameBuffer + queueStarts[0], queueEnd - queueStarts[0]);
+        } else if (peerMsgPack) {
+            // {"messageType":"batch","data":[...]} with an array16 header
+            static const uint8_t prefix[] = {
+                0x82, 0xab, 'm', 'e', 's', 's', 'a', 'g', 'e', 'T', 'y', 'p', 'e',
+                0xa5, 'b', 'a', 't', 'c', 'h', 0xa4, 'd', 'a', 't', 'a', 0xdc};
+            uint8_t *start = frameBuffer + QUEUE_START - sizeof(prefix) - 2;
+            memcpy(start, prefix, sizeof(prefix));
+            start[sizeof(prefix)] = queued >> 8;
+            start[sizeof(prefix) + 1] = queued & 0xff;
+            sent = sendPayload(start, queueEnd - (start - frameBuffer));
+        } else {
+            memcpy(frameBuffer + WEBSOCKETS_MAX_HEADER_SIZE, QUBE_BATCH_PREFIX,
+                   sizeof(QUBE_BATCH_PREFIX) - 1);
+            frameBuffer[queueEnd] = ']';
+            frameBuffer[queueEnd + 1] = '}';
+            sent = sendPayload(frameBuffer + WEBSOCKETS_MAX_HEADER_SIZE,
+                               queueEnd + 2 - WEBSOCKETS_MAX_HEADER_SIZE);
+        }
+        if (!sent) {
+            return false;
         }
+        queued = 0;
+        queueEnd = 0;
+        return true;
+    }
 
-        else if (root["messageType"] == "getAllThings") {
-            QA_LOG("[QA:messageHandler] Received a 'getAllThings' message\n");
-            handleThings();
+    void setDropPolicy(QubeDropPolicy policy) {
+        dropPolicy = policy;
+    }
+
+    // Number of messages dropped because the send queue was full
+    uint32_t droppedMessages() {
+        return dropped;
+    }
+
+    // Sends an error message; `key` and `value` name the item not found
+    void sendError(const char *errorCode, const char *errorMessage,
+                   const char *thingId = nullptr, const char *key = nullptr,
+                   const char *value = nullptr) {
+        StaticJsonDocument<JSON_OBJECT_SIZE(5)> doc;
+        doc["messageType"] = "error";
+        doc["errorCode"] = errorCode;
+        doc["errorMessage"] = errorMessage;
+        if (thingId != nullptr) {
+            doc["thingId"] = thingId;
+        }
+        if (key != nullptr) {
+            doc[key] = value;
         }
+        sendDocument(doc);
+    }
+
 
-        else if (root["messageType"] == "performAction") {
-            QA_LOG("[QA:messageHandler] Received a 'performAction' message\n");
-            String thingId = root["thingId"];
-            String actionId = root["data"]["actionId"];
-            handleThingActionPost(thingId, (const char*)root["data"]);
+    // Parses the message in place: `payload` must be writable and stay valid
+    // until the handlers return, as strings in the document point into it.
+    void messageHandler(uint8_t *payload, size_t length, bool binary = false){
+
+        DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+        DeserializationError error = binary
+            ? deserializeMsgPack(doc, (char *)payload, length)
+            : deserializeJson(doc, (char *)payload, length);
+        if (error) {
+            QA_LOG("[QA:messageHandler] deserializeJson() failed: %s\n", error.c_str());
+            sendError("400", "deserializeJson() failed ");
+            return;
         }
 
-        else {
-            QA_LOG("[QA:messageHandler] Unknown message type received. Payload: %s\n", payload.c_str());
+        const char *messageType = doc["messageType"] | "";
+        MessageRoute *route = findMessageRoute(messageType);
+        if (route == nullptr) {
+            QA_LOG("[QA:messageHandler] Unknown message type received: %s\n", messageType);
             // String msg = "{\"messageType\":\"error\", \"errorMessage\":\"unknown messageType \"}";
             // sendMessage(msg);
+            return;
         }
 
-    }    
+        QA_LOG("[QA:messageHandler] Received a '%s' message\n", messageType);
+        route->handler(doc.as<JsonVariantConst>());
+    }
+
+    /**
+     * Registers `handler` for tunnel messages of the given type, replacing
+     * the handler of a built-in or earlier registered type of the same name.
+     * The handler gets a read-only view of the whole message, which is only
+     * valid during the call. `messageType` must outlive the adapter.
+     * Returns false if QUBE_MAX_MESSAGE_TYPES types are registered already.
+     */
+    bool onMessage(const char *messageType, MessageHandler handler) {
+        uint32_t hash = thingHashBytes(messageType, strlen(messageType));
+        for (size_t i = 0; i < QUBE_MAX_MESSAGE_TYPES; i++) {
+            MessageRoute &route = messageRoutes[(hash + i) % QUBE_MAX_MESSAGE_TYPES];
+            if (route.type == nullptr ||
+                (route.hash == hash && strcmp(route.type, messageType) == 0)) {
+                route.hash = hash;
+                route.type = messageType;
+                route.handler = handler;
+                return true;
+            }
+        }
+        return false;
+    }
 
-    void payloadHandler(uint8_t *payload, size_t length)
+    void payloadHandler(uint8_t *payload, size_t length, bool binary = false)
     {
         // Serial.printf("Got payload -> %s\n", payload);
         QA_LOG("[QA:payloadHandler] New message received!\n");
-        char msgch[length];
-        for (unsigned int i = 0; i < length; i++)
-        {
-            msgch[i] = ((char)payload[i]);
-        }
-        msgch[length] = '\0';
-        String msg = msgch;
-        messageHandler(msg);
+        // WebSocketsClient owns the buffer for the duration of the callback,
+        // so it is parsed without copying
+        messageHandler(payload, length, binary);
     }
 
     void webSocketEvent(WStype_t type, uint8_t *payload, size_t length)
@@ -127,21 +306,46 @@ class QubeAdapter {
         {
         case WStype_DISCONNECTED:
             QA_LOG("[QA:webSocketEvent] Disconnect!\n");
+            peerBatching = false;
+            peerMsgPack = false;
+            peerAcks = false;
+            startAcked = false;
+            queued = 0;
+            queueEnd = 0;
+            scheduleReconnect();
             break;
 
         case WStype_CONNECTED:
             QA_LOG("[QA:webSocketEvent] Connected to tunnel server!\n");
             // Serial.printf("[WSc] Connected to url: %s\n", payload);
-            webSocket.sendTXT("{\"messageType\":\"StartWs\"}");
+            {
+                // Offer batching, acks and, if enabled, MessagePack; the
+                // server confirms what it supports with StartWsAck
+                StaticJsonDocument<JSON_OBJECT_SIZE(4)> start;
+                start["messageType"] = "StartWs";
+                start["batch"] = true;
+                start["ack"] = true;
+                if (messagePack) {
+                    start["msgpack"] = true;
+                }
+                sendFrame(start);
+            }
+            reconnectAttempts = 0;
+            // The next update() sends whatever changed since the last
+            // acknowledged sync; stored messages follow the handshake
+            changes.version = syncedVersion;
+            replayPending = true;
+            connectedAt = millis();
             break;
 
         case WStype_TEXT:
             payloadHandler(payload, length);
             break;
 
-        case WS_EVT_DATA:
+        case WStype_BIN:
             QA_LOG("[QA:webSocketEvent] binary length: %u\n", length);
             // Serial.printf("[WSc] get binary length: %u\n", length);
+            payloadHandler(payload, length, true);
             break;
         
         case WStype_ERROR:
@@ -181,55 +385,252 @@ class QubeAdapter {
         }
 }
 
-    ThingDevice* findDeviceById(String id){
-        ThingDevice *device = this->firstDevice;
-        while(device != nullptr){
-            if(device->id == id){
-                return device;
+    struct MessageRoute {
+        uint32_t hash = 0;
+        const char *type = nullptr;
+        MessageHandler handler;
+    };
+
+    uint8_t *frameBuffer = nullptr;
+    size_t frameBufferSize = 0;
+
+    // Property changes up to changes.version have been sent in this
+    // session, up to syncedVersion the tunnel server has acknowledged them
+    ThingChangeCursor changes;
+    uint32_t syncedVersion = 0;
+    // The propertyStatus messages of the latest round carry its cursor
+    // version; this many of them have not been acknowledged yet
+    uint32_t roundVersion = 0;
+    uint16_t roundUnacked = 0;
+    // Events queued on the devices up to this version are in the outbox
+    uint32_t eventVersion = 0;
+    // Set on connect; the outbox is replayed once StartWsAck has arrived, or
+    // once the handshake timed out
+    bool replayPending = false;
+    bool startAcked = false;
+    unsigned long connectedAt = 0;
+    // The tunnel server acknowledges reliable messages with ack messages
+    bool peerAcks = false;
+    uint8_t reconnectAttempts = 0;
+    unsigned long reconnectInterval = QUBE_RECONNECT_MIN;
+    unsigned long reconnectScheduled = 0;
+
+    // WebSocketsClient retries after the reconnect interval without telling
+    // about failed attempts, so the delay is raised whenever it ran out
+    // without a connection
+    void scheduleReconnect() {
+        reconnectInterval = nextReconnectInterval();
+        reconnectScheduled = millis();
+        webSocket.setReconnectInterval(reconnectInterval);
+    }
+
+    // Exponential backoff with +-25% jitter, so that a fleet of devices
+    // does not reconnect in lockstep after an outage
+    unsigned long nextReconnectInterval() {
+        unsigned long interval = QUBE_RECONNECT_MIN;
+        for (uint8_t i = 0; i < reconnectAttempts && interval < QUBE_RECONNECT_MAX; i++) {
+            interval *= 2;
+        }
+        if (interval > QUBE_RECONNECT_MAX) {
+            interval = QUBE_RECONNECT_MAX;
+        }
+        if (reconnectAttempts < 255) {
+            reconnectAttempts++;
+        }
+        return interval - interval / 4 + random(interval / 2 + 1);
+    }
+
+    // Queued messages are serialized one after another into the frame
+    // buffer, behind room for the frame header and the batch prefix (the
+    // JSON one, which is longer than the MessagePack one)
+    static const size_t QUEUE_START =
+        WEBSOCKETS_MAX_HEADER_SIZE + sizeof(QUBE_BATCH_PREFIX) - 1;
+    bool peerBatching = false;
+    bool messagePack = false;
+    bool peerMsgPack = false;
+    QubeDropPolicy dropPolicy = QUBE_DROP_OLDEST;
+    size_t queueStarts[QUBE_SEND_QUEUE_DEPTH];
+    size_t queueEnd = 0;
+    uint8_t queued = 0;
+    uint32_t dropped = 0;
+
+    // Makes room for a `payloadSize` byte message behind the frame header
+    bool reserveFrameBuffer(size_t payloadSize) {
+        if (frameBufferSize >= WEBSOCKETS_MAX_HEADER_SIZE + payloadSize) {
+            return true;
+        }
+        if (payloadSize < QUBE_FRAME_BUFFER_SIZE) {
+            payloadSize = QUBE_FRAME_BUFFER_SIZE;
+        }
+        uint8_t *buffer = (uint8_t *)realloc(frameBuffer, WEBSOCKETS_MAX_HEADER_SIZE + payloadSize);
+        if (buffer == nullptr) {
+            QA_LOG("[QA:reserveFrameBuffer] Out of memory for a %u byte message\n", payloadSize);
+            return false;
+        }
+        frameBuffer = buffer;
+        frameBufferSize = WEBSOCKETS_MAX_HEADER_SIZE + payloadSize;
+        return true;
+    }
+
+    // Writes `doc` in the negotiated format; the output is truncated to
+    // `size` bytes, a JSON terminator included
+    size_t serializeMessage(JsonDocument &doc, uint8_t *out, size_t size) {
+        if (peerMsgPack) {
+            return serializeMsgPack(doc, out, size);
+        }
+        return serializeJson(doc, (char *)out, size);
+    }
+
+    size_t measureMessage(JsonDocument &doc) {
+        return peerMsgPack ? measureMsgPack(doc) : measureJson(doc);
+    }
+
+    // `payload` must be preceded by WEBSOCKETS_MAX_HEADER_SIZE spare bytes
+    bool sendPayload(uint8_t *payload, size_t length) {
+        if (peerMsgPack) {
+            return webSocket.sendBIN(payload, length, true);
+        }
+        return webSocket.sendTXT(payload, length, true);
+    }
+
+    // Serializes `doc` directly into the frame buffer, behind room for the
+    // WebSocket header, so that WebSocketsClient sends it without a copy.
+    // The send queue has to be empty.
+    void sendFrame(JsonDocument &doc) {
+        size_t length = 0;
+        size_t available = frameBufferSize - WEBSOCKETS_MAX_HEADER_SIZE;
+        if (frameBuffer != nullptr) {
+            length = serializeMessage(doc, frameBuffer + WEBSOCKETS_MAX_HEADER_SIZE, available);
+        }
+        // Output is truncated when the buffer runs out; only measure the
+        // message if it may not have fit
+        if (frameBuffer == nullptr ||
+            (length + 1 >= available && measureMessage(doc) + 1 > available)) {
+            size_t needed = measureMessage(doc) + 1;
+            if (!reserveFrameBuffer(needed)) {
+                return;
             }
-            device = device->next;
+            length = serializeMessage(doc, frameBuffer + WEBSOCKETS_MAX_HEADER_SIZE, needed);
         }
-        return nullptr;
+        sendPayload(frameBuffer + WEBSOCKETS_MAX_HEADER_SIZE, length);
     }
 
-    ThingProperty *findPropertyById(ThingDevice *device, String id){
-        ThingProperty *property = device->firstProperty;
-        while(property != nullptr){
-            if(property->id == id){
-                return property;
+    void queueDocument(JsonDocument &doc) {
+        if (!reserveFrameBuffer(QUBE_FRAME_BUFFER_SIZE)) {
+            return;
+        }
+        // Keep two bytes for the closing "]}"
+        size_t limit = frameBufferSize - 2;
+        for (;;) {
+            // A full queue is sent early, like one that is out of room
+            if (queued == QUBE_SEND_QUEUE_DEPTH && !flushSendQueue() &&
+                !dropForNewMessage()) {
+                return;
+            }
+
+            // JSON messages are separated by a comma at queueEnd
+            size_t start = QUEUE_START;
+            if (queued > 0) {
+                start = peerMsgPack ? queueEnd : queueEnd + 1;
+            }
+            size_t available = limit > start ? limit - start : 0;
+            size_t length = serializeMessage(doc, frameBuffer + start, available + 1);
+            if (length < available ||
+                (length == available && measureMessage(doc) == available)) {
+                if (queued > 0 && !peerMsgPack) {
+                    frameBuffer[queueEnd] = ',';
+                }
+                queueStarts[queued++] = start;
+                queueEnd = start + length;
+                return;
+            }
+
+            if (queued == 0) {
+                // Larger than the whole queue, send it on its own
+                sendFrame(doc);
+                return;
+            }
+            // Out of room: send the batch so far and start a new one. Only
+            // if the socket does not take it, messages are dropped.
+            if (!flushSendQueue() && !dropForNewMessage()) {
+                return;
             }
-            property = (ThingProperty *)property->next;
         }
-        return nullptr;
     }
 
-    ThingAction *findActionById(ThingDevice *device, String id){
-        ThingAction *action = device->firstAction;
-        while(action != nullptr){
-            if(action->id == id){
-                return action;
+    // Applies the drop policy when the queue is full or cannot be sent;
+    // returns false if the new message is dropped
+    bool dropForNewMessage() {
+        dropped++;
+        if (dropPolicy == QUBE_DROP_NEWEST) {
+            QA_LOG("[QA:queueDocument] Send queue full, dropping message\n");
+            return false;
+        }
+
+        QA_LOG("[QA:queueDocument] Send queue full, dropping oldest message\n");
+        if (queued == 1) {
+            queued = 0;
+            queueEnd = 0;
+            return true;
+        }
+        size_t shift = queueStarts[1] - QUEUE_START;
+        memmove(frameBuffer + QUEUE_START, frameBuffer + queueStarts[1], queueEnd - queueStarts[1]);
+        for (uint8_t i = 1; i < queued; i++) {
+            queueStarts[i - 1] = queueStarts[i] - shift;
+        }
+        queued--;
+        queueEnd -= shift;
+        return true;
+    }
+
+    // Open addressing on the FNV-1a hash of the message type; lookups cost
+    // the same however many types are registered
+    MessageRoute messageRoutes[QUBE_MAX_MESSAGE_TYPES];
+
+    MessageRoute *findMessageRoute(const char *messageType) {
+        uint32_t hash = thingHashBytes(messageType, strlen(messageType));
+        for (size_t i = 0; i < QUBE_MAX_MESSAGE_TYPES; i++) {
+            MessageRoute &route = messageRoutes[(hash + i) % QUBE_MAX_MESSAGE_TYPES];
+            if (route.type == nullptr) {
+                return nullptr;
+            }
+            if (route.hash == hash && strcmp(route.type, messageType) == 0) {
+                return &route;
             }
-            action = (ThingAction *)action->next;
         }
         return nullptr;
     }
 
-    ThingEvent *findEventById(ThingDevice *device, String id){
-        ThingEvent *event = device->firstEvent;
-        while(event != nullptr){
-            if(event->id == id){
-                return event;
+    ThingDevice* findDeviceById(const char *id){
+        ThingDevice *device = this->firstDevice;
+        while(device != nullptr){
+            if(device->id == id){
+                return device;
             }
-            event = (ThingEvent *)event->next;
+            device = device->next;
         }
         return nullptr;
     }
 
+    ThingProperty *findPropertyById(ThingDevice *device, const char *id){
+        return device->findProperty(id);
+    }
+
+    ThingAction *findActionById(ThingDevice *device, const char *id){
+        return device->findAction(id);
+    }
+
+    ThingEvent *findEventById(ThingDevice *device, const char *id){
+        return device->findEvent(id);
+    }
+
     // Begin method
     void begin(String websocketUrl, int websocketPort, String websocketPath) {
 
         // server address, port and URL
+        thingFreezeDevices(firstDevice);
         webSocket.begin(websocketUrl, websocketPort, websocketPath);
+        outbox.begin();
         // event handler
         webSocket.onEvent(std::bind(
         &QubeAdapter::webSocketEvent, this,std::placeholders::_1,
@@ -239,7 +640,9 @@ class QubeAdapter {
     void beginSSL(String websocketUrl, int websocketPort, String websocketPath) {
 
         // server address, port and URL
+        thingFreezeDevices(firstDevice);
         webSocket.beginSSL(websocketUrl.c_str(), websocketPort, websocketPath.c_str());
+        outbox.begin();
         // event handler
         webSocket.onEvent(std::bind(
         &QubeAdapter::webSocketEvent, this,std::placeholders::_1,
@@ -258,19 +661,128 @@ class QubeAdapter {
     //     std::placeholders::_2, std::placeholders::_3));
     // }
 
-    // Update method
-    void update(){
-        
+    // Update method. Returns the millis() time by which it has to be called
+    // again: now if work is pending, otherwise the next scheduled function,
+    // reconnect attempt or background refresh, at most THING_MAX_SLEEP ms
+    // ahead. With a `budget` in microseconds, events and the outbox replay
+    // wait for the next call once it is used up.
+    unsigned long update(unsigned long budget = 0){
+        unsigned long start = micros();
+        thingApplyValuesFromISR(firstDevice);
+        thingScheduler().run();
         webSocket.loop();
+        if (!webSocket.isConnected() && millis() - reconnectScheduled >= reconnectInterval) {
+            scheduleReconnect();
+        }
         #ifndef WITHOUT_WS
         // * Send changed properties as defined in "4.5 propertyStatus message"
-        // Do this by looping over all devices and properties
+        // Do this by looping over all devices and properties. Changes made
+        // while disconnected stay pending, as the cursor does not move.
+        // The tunnel watches every device while it is connected
+        if (webSocket.isConnected()) {
+            ThingDevice *device = this->firstDevice;
+            while (device != nullptr) {
+                device->refreshProperties();
+                device = device->next;
+            }
+        }
+        if (webSocket.isConnected() && changes.poll()) {
+            roundVersion = changes.version;
+            roundUnacked = 0;
+            ThingDevice *device = this->firstDevice;
+            while (device != nullptr) {
+                sendChangedProperties(device);
+                device = device->next;
+            }
+        }
+        #endif
+
+        if (budget > 0 && micros() - start >= budget) {
+            flushSendQueue();
+            return millis();
+        }
+
+        // Events are kept in the outbox whether connected or not
+        if (thingVersionClock() != eventVersion) {
+            uint32_t since = eventVersion;
+            eventVersion = thingVersionClock();
+            ThingDevice *device = this->firstDevice;
+            while (device != nullptr) {
+                sendEvents(device, device->eventQueue, since);
+                device = device->next;
+            }
+        }
+        // Servers without the handshake never answer StartWs; they get the
+        // stored messages once and everything else directly
+        if (!startAcked && webSocket.isConnected() &&
+            millis() - connectedAt >= QUBE_HANDSHAKE_TIMEOUT) {
+            startAcked = true;
+        }
+        if (replayPending && startAcked && webSocket.isConnected()) {
+            replayPending = false;
+            DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
+            outbox.replay(message, [this](JsonDocument &doc) {
+                sendDocument(doc);
+            });
+            // Without acks, the messages are only sent once
+            if (!peerAcks) {
+                outbox.clear();
+            }
+        }
+        flushSendQueue();
+        return nextDeadline();
+    }
+
+    unsigned long nextDeadline() {
+        unsigned long now = millis();
+        if (thingISRPending() || thingVersionClock() != eventVersion) {
+            return now;
+        }
+        unsigned long deadline = thingScheduler().nextDeadline(now + THING_MAX_SLEEP);
+        if (!webSocket.isConnected()) {
+            return thingEarlier(reconnectScheduled + reconnectInterval, deadline);
+        }
+        if ((replayPending && startAcked) ||
+            thingVersionClock() != changes.version) {
+            return now;
+        }
+        if (!startAcked) {
+            deadline = thingEarlier(connectedAt + QUBE_HANDSHAKE_TIMEOUT, deadline);
+        }
         ThingDevice *device = this->firstDevice;
         while (device != nullptr) {
-            sendChangedProperties(device);
+            deadline = device->refreshDeadline(deadline);
             device = device->next;
         }
-        #endif
+        return deadline;
+    }
+
+    // Sends an actionStatus message, tagged with the thingId, as defined in
+    // "4.6 actionStatus message"
+    void sendActionStatus(ThingDevice *device, ThingActionObject *action) {
+        DynamicJsonDocument message(SMALL_JSON_DOCUMENT_SIZE);
+        message["messageType"] = "actionStatus";
+        message["thingId"] = device->id;
+        JsonObject data = message.createNestedObject("data");
+        action->serialize(data, device->id);
+        sendReliable(message);
+    }
+
+    // Sends the events queued on `device` after version `since` as defined
+    // in "4.7 event message". The queue is newest first; recurse to send
+    // the oldest first.
+    void sendEvents(ThingDevice *device, ThingEventObject *obj, uint32_t since) {
+        if (obj == nullptr || obj->version <= since) {
+            return;
+        }
+        sendEvents(device, obj->next, since);
+
+        DynamicJsonDocument message(SMALL_JSON_DOCUMENT_SIZE);
+        message["messageType"] = "event";
+        message["thingId"] = device->id;
+        JsonObject data = message.createNestedObject("data");
+        obj->serialize(data);
+        sendReliable(message);
     }
 
     // Add device method
@@ -287,33 +799,33 @@ class QubeAdapter {
 
     }
 
+    // Sends the properties of `device` changed in the current round of the
+    // change cursor. The message carries the round's version, which the
+    // tunnel server confirms with a propertyAck message.
     void sendChangedProperties(ThingDevice *device) {
-    // Prepare one buffer per device
+        ThingItem *item = changes.first(device);
+        if (item == nullptr) {
+            return;
+        }
+        // Prepare one buffer per device
         DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
         message["messageType"] = "propertyStatus";
+        message["thingId"] = device->id;
+        message["version"] = roundVersion;
+        roundUnacked++;
         JsonObject prop = message.createNestedObject("data");
-        bool dataToSend = false;
-        ThingItem *item = device->firstProperty;
         while (item != nullptr) {
-            ThingDataValue *value = item->changedValueOrNull();
-            if (value) {
-                dataToSend = true;
-                item->serializeValue(prop);
-            }
-            item = item->next;
-        }
-        if (dataToSend) {
-            String jsonStr;
-            message["thingId"] = device->id;
-            serializeJson(message, jsonStr);
-            sendMessage(jsonStr);
+            item->serializeValue(prop);
+            item = changes.next(item);
         }
+        sendDocument(message);
     }
 
     // This is function is callback for `/things`
     void handleThings(){
-        DynamicJsonDocument buf(LARGE_JSON_DOCUMENT_SIZE);
-        JsonArray things = buf.to<JsonArray>();
+        DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+        doc["messageType"] = "descriptionOfThings";
+        JsonArray things = doc.createNestedArray("things");
         ThingDevice *device = this->firstDevice;
         while (device != nullptr) {
             JsonObject descr = things.createNestedObject();
@@ -321,82 +833,66 @@ class QubeAdapter {
             descr["href"] = "/things/" + device->id;
             device = device->next;   
         }
-        StaticJsonDocument<LARGE_JSON_DOCUMENT_SIZE> doc;
-        JsonObject doc2 = doc.to<JsonObject>();
-        doc2["messageType"] = "descriptionOfThings";
-        doc2["things"] = things;
-        String jsonStr;
-        serializeJson(doc2, jsonStr);
-        sendMessage(jsonStr);
+        sendDocument(doc);
         QA_LOG("[QA:handleThings] Thing description of all devices sent!\n");
     }
 
     // This is function is callback for `/things/{thingId}`
-    void handleThing(String thingId) {
+    void handleThing(const char *thingId) {
 
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-            sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         DynamicJsonDocument buf(LARGE_JSON_DOCUMENT_SIZE);
         JsonObject descr = buf.to<JsonObject>();
         device->serialize(descr, ip, port);
-        String jsonStr;
-        serializeJson(descr, jsonStr);
-        sendMessage(jsonStr);
+        sendDocument(buf);
 
         QA_LOG("[QA:handleThing] Thing description sent!\n");
     }   
 
     // This is function is callback for GET `/things/{thingId}/properties`
-    void handleThingPropertyGet(String thingId, String propertyId) {
+    void handleThingPropertyGet(const char *thingId, const char *propertyId) {
 
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         ThingItem *item = findPropertyById(device, propertyId);
         if (item == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Property not found\", \"thingId\": \"" + thingId + "\", \"propertyId\": \"" + propertyId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Property not found", thingId, "propertyId", propertyId);
+            return;
         }
         DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
-        JsonObject prop = doc.to<JsonObject>();
-        item->serializeValue(prop);
-        DynamicJsonDocument finalDoc(SMALL_JSON_DOCUMENT_SIZE);
-        JsonObject finalProp = finalDoc.to<JsonObject>();
-        finalDoc["messageType"] = "getProperty";
-        finalDoc["thingId"] = thingId;
-        finalDoc["properties"] = prop;
-        String jsonStr;
-        serializeJson(finalProp, jsonStr);
-        sendMessage(jsonStr);
+        doc["messageType"] = "getProperty";
+        doc["thingId"] = thingId;
+        item->serializeValue(doc.createNestedObject("properties"));
+        sendDocument(doc);
     }
 
     // This is function is callback for GET `/things/{thingId}/actions/{actionId}`
-    void handleThingActionGet(String thingId, String actionId) {
+    void handleThingActionGet(const char *thingId, const char *actionId) {
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         ThingAction *action = findActionById(device, actionId);
         if (action == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Action not found\", \"thingId\": \"" + thingId + "\", \"actionId\": \"" + actionId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Action not found", thingId, "actionId", actionId);
+            return;
         }
         DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
         JsonArray queue = doc.to<JsonArray>();
         device->serializeActionQueue(queue, action->id);
-        String jsonStr;
-        serializeJson(queue, jsonStr);
-        sendMessage(jsonStr);
+        sendDocument(doc);
     }
 
     // Delete action from queue
-    void handleThingActionDelete(String thingId, String actionId){
+    void handleThingActionDelete(const char *thingId, const char *actionId){
         
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
@@ -406,18 +902,18 @@ class QubeAdapter {
     }
 
     // This function is callback for POST `/things/{thingId}/actions/{actionId}`
-    void handleThingActionPost(String thingId, const char *newActionData){
+    void handleThingActionPost(const char *thingId, JsonVariantConst newActionData){
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
             return;
         }
         DynamicJsonDocument *newBuffer =
         new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-        auto error = deserializeJson(*newBuffer, newActionData);
-        if (error) {
+        // Copies the request, which outlives the message it came with
+        if (!newActionData.is<JsonObject>() || !newBuffer->set(newActionData)) {
             // send error as response
-            Serial.print(F("[handleThingActionsPost()] deserializeJson() failed with code "));
-            Serial.println(error.c_str());
+            Serial.println(F("[handleThingActionsPost()] action request is not an object or too large"));
+            delete newBuffer;
             return;
         }
         // JsonObject newAction = newBuffer->as<JsonObject>();
@@ -430,104 +926,78 @@ class QubeAdapter {
             return;
         }
 
-        // TODO add notify func
-        // obj->setNotifyFunction([](ThingActionObject *action){
-        //             DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
-        //             message["messageType"] = "actionStatus";
-        //             message["thingId"] = action->device->id;
-        //             JsonObject prop = message.createNestedObject("data");
-        //             action->serialize(prop, device->id);
-        //             String jsonStr;
-        //             serializeJson(message, jsonStr);
-        //             sendMessage(jsonStr);
-        //         });
+        obj->setNotifyFunction([this, device](ThingActionObject *action) {
+            sendActionStatus(device, action);
+        });
+        sendActionStatus(device, obj);
 
-        DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
-        JsonObject item = respBuffer.to<JsonObject>();
-        obj->serialize(item, device->id);
-        String jsonStr;
-        serializeJson(item, jsonStr);
         obj->start();
 
         QA_LOG("[QA:handleThingActionPost] Action for the particular thing has been started.\n");
     }
 
     // This function is callback for GET `/things/{thingId}/events/{eventId}`
-    void handleThingEventGet(String thingId, String eventId){
+    void handleThingEventGet(const char *thingId, const char *eventId){
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         ThingItem *item = findEventById(device, eventId);
         if (item == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Event not found\", \"thingId\": \"" + thingId + "\", \"eventId\": \"" + eventId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Event not found", thingId, "eventId", eventId);
+            return;
         }
         DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
         JsonArray queue = doc.to<JsonArray>();
         device->serializeEventQueue(queue, item->id);
-        String jsonStr;
-        serializeJson(queue, jsonStr);
-        sendMessage(jsonStr);
+        sendDocument(doc);
     }
 
     // This function is callback for GET `/things/{thingId}/properties`
-    void handleThingPropertiesGet(String thingId){
-        ThingItem *rootItem = findDeviceById(thingId)->firstProperty;
-        if (rootItem == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+    void handleThingPropertiesGet(const char *thingId){
+        ThingDevice *device = findDeviceById(thingId);
+        if (device == nullptr) {
+            sendError("404", "Thing not found", thingId);
+            return;
         }
 
-        // TODO Instead of using two DyanmicJsonDocument, use one
         DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
-        JsonObject prop = doc.to<JsonObject>();
-        ThingItem *item = rootItem;
-        while (item != nullptr) {
-            item->serializeValue(prop);
-            item = item->next;
-        }
-        DynamicJsonDocument finalDoc(SMALL_JSON_DOCUMENT_SIZE);
-        JsonObject finalProp = finalDoc.to<JsonObject>();
-        finalDoc["messageType"] = "getProperty";
-        finalDoc["thingId"] = thingId;
-        finalDoc["properties"] = prop;
-        String jsonStr;
-        serializeJson(finalProp, jsonStr);
-        sendMessage(jsonStr);
+        doc["messageType"] = "getProperty";
+        doc["thingId"] = thingId;
+        JsonObject prop = doc.createNestedObject("properties");
+        device->serializeValues(prop);
+        sendDocument(doc);
         QA_LOG("[QA:handleThingPropertiesGet] Property data was sent back.\n");
     }
 
     // This function is callback for POST `/things/{thingId}/actions`
-    void handleThingActionsGet(String thingId){
+    void handleThingActionsGet(const char *thingId){
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
         JsonArray queue = doc.to<JsonArray>();
         device->serializeActionQueue(queue);
-        String jsonStr;
-        serializeJson(queue, jsonStr);
-        sendMessage(jsonStr);
+        sendDocument(doc);
     }
 
     // This function is callback for POST `/things/{thingId}/actions`
-    void handleThingActionsPost(String thingId, const char *newActionData){
+    void handleThingActionsPost(const char *thingId, JsonVariantConst newActionData){
        ThingDevice *device = findDeviceById(thingId);
        if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         DynamicJsonDocument *newBuffer =
         new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-        auto error = deserializeJson(*newBuffer, newActionData);
-        if (error) {
+        // Copies the request, which outlives the message it came with
+        if (!newActionData.is<JsonObject>() || !newBuffer->set(newActionData)) {
             // send error as response
-            Serial.print(F("[handleThingActionPost()] deserializeJson() failed with code "));
-            Serial.println(error.c_str());
+            Serial.println(F("[handleThingActionPost()] action request is not an object or too large"));
+            delete newBuffer;
             return;
         }
         // JsonObject newAction = newBuffer->as<JsonObject>();
@@ -537,45 +1007,34 @@ class QubeAdapter {
             // Send error as response
             Serial.println(F("[handleThingActionPost()] requestAction() failed. Obj was nullptr."));
             delete newBuffer;
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Request action was null ptr.\", \"thingId\": \"" + thingId + "\", \"actionId\": \"" + obj->id + "\"}";
-           sendMessage(msg);
-        }
-
-        // TODO add notify_fn_
-        // obj->setNotifyFunction([](ThingActionObject *action){
-        //             DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
-        //             message["messageType"] = "actionStatus";
-        //             message["thingId"] = device->id;
-        //             JsonObject prop = message.createNestedObject("data");
-        //             action->serialize(prop, device->id);
-        //             String jsonStr;
-        //             serializeJson(message, jsonStr);
-        //             this->sendMessage(jsonStr);
-        //         });
+            sendError("404", "Request action was null ptr.", thingId);
+            return;
+        }
+
+        obj->setNotifyFunction([this, device](ThingActionObject *action) {
+            sendActionStatus(device, action);
+        });
+        sendActionStatus(device, obj);
 
         DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
         JsonObject item = respBuffer.to<JsonObject>();
         obj->serialize(item, device->id);
-        String jsonStr;
-        serializeJson(item, jsonStr);
         obj->start();
-        sendMessage(jsonStr);
+        sendDocument(respBuffer);
     }
 
     // This function is callback for GET `/things/{thingId}/events`
-    void handleThingEventsGet(String thingId) {
+    void handleThingEventsGet(const char *thingId) {
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
-            String msg = "{\"messageType\":\"error\",\"errorCode\":\"404\",\"errorMessage\":\"Thing not found\", \"thingId\": \"" + thingId + "\"}";
-           sendMessage(msg);
+            sendError("404", "Thing not found", thingId);
+            return;
         }
         DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
         JsonArray queue = doc.to<JsonArray>();
         device->serializeEventQueue(queue);
-        String jsonStr;
         queue[0]["data"]["thingId"] = thingId;
-        serializeJson(queue, jsonStr);
-        sendMessage(jsonStr);
+        sendDocument(doc);
     }
 
     // This function was used to call handleBody for all requests
@@ -589,35 +1048,28 @@ class QubeAdapter {
     }
 
     // This function is callback for PUT `/things/{thingId}/properties/{propertyId}`
-    void handleThingPropertyPut(String thingId, String propertyId, String newPropertyData){
-
+    void handleThingPropertyPut(const char *thingId, const char *propertyId, JsonVariantConst newPropertyData){
 
         ThingDevice *device = findDeviceById(thingId);
         if (device == nullptr) {
+            sendError("404", "Thing not found", thingId);
             return;
         }
         ThingProperty *property = findPropertyById(device, propertyId);
         if (property == nullptr) {
+            sendError("404", "Property not found", thingId, "propertyId", propertyId);
             return;
         }
-        DynamicJsonDocument newBuffer(LARGE_JSON_DOCUMENT_SIZE);
-        auto error = deserializeJson(newBuffer, newPropertyData);
 
-        if (error) { 
-            // unable to parse json
-            Serial.println("Unable to parse json for property PUT request V2");
-            Serial.println(error.c_str());
-            // serializeJsonPretty(newPropertyData, Serial);
-            return;
-        }
+        JsonVariantConst value = newPropertyData["value"];
+        device->setProperty(property->id.c_str(), value);
 
-        newBuffer["thingId"] = thingId;
-        newBuffer["messageType"] = "updatedProperty";
-        JsonObject newProp = newBuffer.as<JsonObject>();
-        device->setProperty(property->id.c_str(), newProp["value"]);
-        String jsonStr;
-        serializeJson(newProp, jsonStr);
-        sendMessage(jsonStr);
+        DynamicJsonDocument ack(SMALL_JSON_DOCUMENT_SIZE);
+        ack["messageType"] = "updatedProperty";
+        ack["thingId"] = thingId;
+        ack["propertyId"] = property->id.c_str();
+        ack["value"] = value;
+        sendDocument(ack);
 
         QA_LOG("[QA:handleThingPropertyPut] Property value has been set! \n");
     }
@@ -0,0 +1,277 @@
+/**
+ * QubeOutbox.h
+ *
+ * Store-and-forward buffer for tunnel messages that must not get lost while
+ * the Qube tunnel is down. Messages get increasing sequence numbers, are
+ * kept (as MessagePack) until the tunnel server acknowledges them and can be
+ * replayed in order after a reconnect. When the RAM ring is full, the oldest
+ * records can be spilled to a log file: on LittleFS on the device, or a
+ * plain file in host builds.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#ifdef QUBE_OUTBOX_SPILL
+#if defined(ESP32) || defined(ESP8266)
+#include <LittleFS.h>
+#else
+#include <stdio.h>
+#endif
+#endif
+
+// Number of messages kept in RAM
+#ifndef QUBE_OUTBOX_DEPTH
+#define QUBE_OUTBOX_DEPTH 16
+#endif
+
+// Largest message (in MessagePack bytes) the outbox keeps; larger ones are
+// only sent while connected
+#ifndef QUBE_OUTBOX_RECORD_SIZE
+#define QUBE_OUTBOX_RECORD_SIZE 192
+#endif
+
+#ifdef QUBE_OUTBOX_SPILL
+#ifndef QUBE_OUTBOX_SPILL_PATH
+#define QUBE_OUTBOX_SPILL_PATH "/qube-outbox.log"
+#endif
+
+// Upper bound of the spill file in bytes
+#ifndef QUBE_OUTBOX_SPILL_SIZE
+#define QUBE_OUTBOX_SPILL_SIZE 16384
+#endif
+#endif
+
+// What to drop when the outbox is full
+enum QubeOutboxPolicy {
+  // Keep the newest messages
+  QUBE_OUTBOX_DROP_OLDEST,
+  // Keep the oldest messages, e.g. the first events of an outage
+  QUBE_OUTBOX_DROP_NEWEST
+};
+
+class QubeOutbox {
+public:
+  /**
+   * Restores the sequence number from a spill file left by a previous boot,
+   * so that new messages continue after the spilled ones.
+   */
+  void begin() {
+#ifdef QUBE_OUTBOX_SPILL
+    forEachSpilled([this](uint32_t seq, const uint8_t *, uint16_t) {
+      if (seq > lastSeq) {
+        lastSeq = seq;
+      }
+      spilledSeq = seq;
+    });
+#endif
+  }
+
+  void setPolicy(QubeOutboxPolicy policy_) { policy = policy_; }
+
+  /**
+   * Adds `doc` after setting its "seq" member. Returns the sequence number,
+   * or 0 if the message could not be stored.
+   */
+  uint32_t push(JsonDocument &doc) {
+    uint32_t seq = lastSeq + 1;
+    doc["seq"] = seq;
+    size_t length = measureMsgPack(doc);
+    if (length > QUBE_OUTBOX_RECORD_SIZE ||
+        (count == QUBE_OUTBOX_DEPTH && !evictOldest())) {
+      dropped++;
+      doc.remove("seq");
+      return 0;
+    }
+
+    Record &record = records[(first + count) % QUBE_OUTBOX_DEPTH];
+    record.seq = seq;
+    record.length = serializeMsgPack(doc, record.data, sizeof(record.data));
+    count++;
+    lastSeq = seq;
+    return seq;
+  }
+
+  /**
+   * Drops every message up to and including `seq`.
+   */
+  void ack(uint32_t seq) {
+    if (seq > ackedSeq && seq <= lastSeq) {
+      ackedSeq = seq;
+    }
+    while (count > 0 && records[first].seq <= ackedSeq) {
+      first = (first + 1) % QUBE_OUTBOX_DEPTH;
+      count--;
+    }
+#ifdef QUBE_OUTBOX_SPILL
+    if (spilledSeq != 0 && spilledSeq <= ackedSeq) {
+      removeSpill();
+    }
+#endif
+  }
+
+  /**
+   * Drops every message, e.g. after sending them to a tunnel server that
+   * does not acknowledge messages.
+   */
+  void clear() { ack(lastSeq); }
+
+  /**
+   * Calls `send(JsonDocument &)` for every unacknowledged message, oldest
+   * first. `doc` is used to decode them.
+   */
+  template <typename F> void replay(JsonDocument &doc, F send) {
+#ifdef QUBE_OUTBOX_SPILL
+    forEachSpilled([&](uint32_t seq, const uint8_t *data, uint16_t length) {
+      if (seq > ackedSeq && !deserializeMsgPack(doc, data, length)) {
+        send(doc);
+      }
+    });
+#endif
+    for (uint8_t i = 0; i < count; i++) {
+      Record &record = records[(first + i) % QUBE_OUTBOX_DEPTH];
+      if (record.seq > ackedSeq &&
+          !deserializeMsgPack(doc, record.data, record.length)) {
+        send(doc);
+      }
+    }
+  }
+
+  // Number of messages that were not kept, or dropped later, because the
+  // outbox was full or they were too large
+  uint32_t droppedMessages() { return dropped; }
+
+private:
+  struct Record {
+    uint32_t seq;
+    uint16_t length;
+    uint8_t data[QUBE_OUTBOX_RECORD_SIZE];
+  };
+
+  Record records[QUBE_OUTBOX_DEPTH];
+  uint8_t first = 0;
+  uint8_t count = 0;
+  uint32_t lastSeq = 0;
+  uint32_t ackedSeq = 0;
+  uint32_t dropped = 0;
+  QubeOutboxPolicy policy = QUBE_OUTBOX_DROP_OLDEST;
+
+  // Makes room by moving the oldest record to the spill file or, if the
+  // policy allows, dropping it. Returns false if the new message has to go.
+  bool evictOldest() {
+    Record &oldest = records[first];
+    if (canSpill(oldest.length)) {
+      spill(oldest);
+    } else if (policy == QUBE_OUTBOX_DROP_NEWEST) {
+      return false;
+    } else {
+      dropped++;
+    }
+    first = (first + 1) % QUBE_OUTBOX_DEPTH;
+    count--;
+    return true;
+  }
+
+#ifdef QUBE_OUTBOX_SPILL
+  // Highest sequence number in the spill file, 0 if there is none
+  uint32_t spilledSeq = 0;
+  size_t spilledBytes = 0;
+
+  static const size_t SPILL_HEADER_SIZE = 6;
+
+  bool canSpill(size_t length) {
+    return spilledBytes + SPILL_HEADER_SIZE + length <= QUBE_OUTBOX_SPILL_SIZE;
+  }
+
+  // Appends the record as sequence number and length (little endian)
+  // followed by its data
+  void spill(const Record &record) {
+    uint8_t header[SPILL_HEADER_SIZE];
+    for (uint8_t i = 0; i < 4; i++) {
+      header[i] = record.seq >> (8 * i);
+    }
+    header[4] = record.length & 0xff;
+    header[5] = record.length >> 8;
+
+#if defined(ESP32) || defined(ESP8266)
+    File file = LittleFS.open(QUBE_OUTBOX_SPILL_PATH, "a");
+    if (!file) {
+      dropped++;
+      return;
+    }
+    file.write(header, sizeof(header));
+    file.write(record.data, record.length);
+    file.close();
+#else
+    FILE *file = fopen(QUBE_OUTBOX_SPILL_PATH, "ab");
+    if (file == nullptr) {
+      dropped++;
+      return;
+    }
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(record.data, 1, record.length, file);
+    fclose(file);
+#endif
+    spilledBytes += sizeof(header) + record.length;
+    spilledSeq = record.seq;
+  }
+
+  template <typename F> void forEachSpilled(F callback) {
+    uint8_t header[SPILL_HEADER_SIZE];
+    uint8_t data[QUBE_OUTBOX_RECORD_SIZE];
+    spilledBytes = 0;
+#if defined(ESP32) || defined(ESP8266)
+    File file = LittleFS.open(QUBE_OUTBOX_SPILL_PATH, "r");
+    if (!file) {
+      return;
+    }
+    while (file.read(header, sizeof(header)) == sizeof(header)) {
+      uint16_t length = header[4] | (header[5] << 8);
+      if (length > sizeof(data) || file.read(data, length) != length) {
+        break;
+      }
+#else
+    FILE *file = fopen(QUBE_OUTBOX_SPILL_PATH, "rb");
+    if (file == nullptr) {
+      return;
+    }
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+      uint16_t length = header[4] | (header[5] << 8);
+      if (length > sizeof(data) || fread(data, 1, length, file) != length) {
+        break;
+      }
+#endif
+      uint32_t seq = 0;
+      for (uint8_t i = 0; i < 4; i++) {
+        seq |= (uint32_t)header[i] << (8 * i);
+      }
+      spilledBytes += sizeof(header) + length;
+      callback(seq, data, length);
+    }
+#if defined(ESP32) || defined(ESP8266)
+    file.close();
+#else
+    fclose(file);
+#endif
+  }
+
+  void removeSpill() {
+#if defined(ESP32) || defined(ESP8266)
+    LittleFS.remove(QUBE_OUTBOX_SPILL_PATH);
+#else
+    ::remove(QUBE_OUTBOX_SPILL_PATH);
+#endif
+    spilledSeq = 0;
+    spilledBytes = 0;
+  }
+#else
+  bool canSpill(size_t) { return false; }
+  void spill(const Record &) {}
+#endif
+};
@@ -22,6 +22,9 @@
 #define ARDUINOJSON_USE_LONG_LONG 1
 #include <ArduinoJson.h>
 
+#include "ThingScheduler.h"
+#include "ThingSync.h"
+
 #ifndef LARGE_JSON_DOCUMENT_SIZE
 #ifdef LARGE_JSON_BUFFERS
 #define LARGE_JSON_DOCUMENT_SIZE 4096
@@ -38,6 +41,59 @@
 #endif
 #endif
 
+/**
+ * 32 bit FNV-1a hash. Usable in constant expressions, and chainable: passing
+ * the hash of a prefix as `h` continues hashing where the prefix ended.
+ */
+constexpr uint32_t thingHash(const char *s, uint32_t h = 2166136261UL) {
+  return *s ? thingHash(s + 1, (h ^ (uint8_t)*s) * 16777619UL) : h;
+}
+
+/**
+ * Same as {@link thingHash} for a string that is not null-terminated.
+ */
+inline uint32_t thingHashBytes(const char *s, size_t length,
+                               uint32_t h = 2166136261UL) {
+  while (length--) {
+    h = (h ^ (uint8_t)*s++) * 16777619UL;
+  }
+  return h;
+}
+
+/**
+ * Global change counter. Every property change is stamped with the next
+ * value, so versions can be compared across items and devices.
+ */
+inline uint32_t &thingVersionClock() {
+  static uint32_t clock = 0;
+  return clock;
+}
+
+// Attribute for functions called from interrupt handlers
+#if defined(ESP32) || defined(ESP8266)
+#define THING_ISR_ATTR IRAM_ATTR
+#else
+#define THING_ISR_ATTR
+#endif
+
+/**
+ * Set from interrupt handlers when a value is waiting in
+ * ThingItem::setValueFromISR(), cleared by thingApplyValuesFromISR().
+ */
+THING_ISR_ATTR inline uint8_t &thingISRPending() {
+  static uint8_t pending = 0;
+  return pending;
+}
+
+// Advances the version clock and returns the new version
+inline uint32_t thingNextVersion() {
+#if THING_CONCURRENT
+  return __atomic_add_fetch(&thingVersionClock(), 1, __ATOMIC_RELAXED);
+#else
+  return ++thingVersionClock();
+#endif
+}
+
 enum ThingDataType { NO_STATE, BOOLEAN, NUMBER, INTEGER, STRING };
 typedef ThingDataType ThingPropertyType;
 
@@ -65,14 +121,33 @@ public:
   String timeCompleted;
   String status;
   String id;
+  // Stamped from thingVersionClock() on every status change
+  uint32_t version = 0;
   ThingActionObject *next = nullptr;
+  // Set while ThingDevice::startActionObject() runs the action; a
+  // removeAction() meanwhile only unlinks it and leaves deleting it to the
+  // start
+  bool starting = false;
+  bool removed = false;
 
+#if THING_CONCURRENT
+private:
+  // What serialize() reports. Other tasks serialize the action while its
+  // own task sets the status, so setStatus() copies both under statusLock
+  // into buffers that never allocate.
+  ThingSpinLock statusLock;
+  char statusCopy[16] = "created";
+  char timeCompletedCopy[32] = "";
+
+public:
+#endif
   ThingActionObject(const char *name_, DynamicJsonDocument *actionRequest_,
                     void (*start_fn_)(const JsonVariant &),
                     void (*cancel_fn_)())
       : start_fn(start_fn_), cancel_fn(cancel_fn_), name(name_),
         actionRequest(actionRequest_),
-        timeRequested("1970-01-01T00:00:00+00:00"), status("created") {
+        timeRequested("1970-01-01T00:00:00+00:00"), status("created"),
+        version(thingNextVersion()) {
     generateId();
   }
 
@@ -102,18 +177,46 @@ public:
     JsonObject inner = actionObj[name];
     data["input"] = inner["input"];
 
+#if THING_CONCURRENT
+    char statusNow[sizeof(statusCopy)];
+    char timeCompletedNow[sizeof(timeCompletedCopy)];
+    statusLock.lock();
+    memcpy(statusNow, statusCopy, sizeof(statusNow));
+    memcpy(timeCompletedNow, timeCompletedCopy, sizeof(timeCompletedNow));
+    statusLock.unlock();
+
+    data["status"] = statusNow;
+    data["timeRequested"] = timeRequested;
+
+    if (timeCompletedNow[0] != '\0') {
+      data["timeCompleted"] = timeCompletedNow;
+    }
+#else
     data["status"] = status;
     data["timeRequested"] = timeRequested;
 
     if (timeCompleted != "") {
       data["timeCompleted"] = timeCompleted;
     }
+#endif
 
     data["href"] = "/things/" + deviceId + "/actions/" + name + "/" + id;
   }
 
+  /**
+   * Sets the status. Set timeCompleted before, so that both change together
+   * for other tasks.
+   */
   void setStatus(const char *s) {
     status = s;
+#if THING_CONCURRENT
+    statusLock.lock();
+    strncpy(statusCopy, s, sizeof(statusCopy) - 1);
+    strncpy(timeCompletedCopy, timeCompleted.c_str(),
+            sizeof(timeCompletedCopy) - 1);
+    statusLock.unlock();
+#endif
+    version = thingNextVersion();
 
 #ifndef WITHOUT_WS
     if (notify_fn != nullptr) {
@@ -136,6 +239,10 @@ public:
     if (cancel_fn != nullptr) {
       cancel_fn();
     }
+    // A finished action keeps its status
+    if (status != "completed") {
+      setStatus("cancelled");
+    }
   }
 
   void finish() {
@@ -155,6 +262,8 @@ public:
   String type;
   JsonObject *input;
   ThingAction *next = nullptr;
+  // Index in the device's action array, see ThingDevice::freeze()
+  uint16_t ordinal = 0;
 
   ThingAction(const char *id_,
               ThingActionObject *(*generator_fn_)(DynamicJsonDocument *))
@@ -203,6 +312,19 @@ public:
   }
 };
 
+class ThingItem;
+
+/**
+ * The properties of a device that have changed, ordered by the version of
+ * their last change, newest first.
+ */
+struct ThingChangeList {
+  ThingItem *newest = nullptr;
+#if THING_CONCURRENT
+  ThingSpinLock lock;
+#endif
+};
+
 class ThingItem {
 public:
   String id;
@@ -210,6 +332,10 @@ public:
   ThingDataType type;
   String atType;
   ThingItem *next = nullptr;
+  // Index in the device's property or event array, see ThingDevice::freeze()
+  uint16_t ordinal = 0;
+  // Definition in a ThingSchema that this item takes its description from
+  const ThingItem *shared = nullptr;
 
   bool readOnly = false;
   String unit = "";
@@ -220,21 +346,72 @@ public:
 
   ThingItem(const char *id_, const char *description_, ThingDataType type_,
             const char *atType_)
-      : id(id_), description(description_), type(type_), atType(atType_) {}
+      : id(id_), description(description_), type(type_), atType(atType_) {
+#if THING_CONCURRENT
+    if (type_ == STRING) {
+      this->value.string = &this->strings[0];
+      return;
+    }
+#endif
+    // Clears all of the union, so NUMBER and INTEGER values start at 0 too
+    this->value.integer = 0;
+  }
 
+  /**
+   * Sets the value. With THING_CONCURRENT, string values are copied into
+   * storage owned by the item, and the String passed in is not updated by
+   * later changes; use getString() to read them.
+   */
   void setValue(ThingDataValue newValue) {
+#if THING_CONCURRENT
+    if (this->type == STRING) {
+      if (newValue.string != nullptr) {
+        this->setValue(newValue.string->c_str());
+      }
+      return;
+    }
+#endif
+    this->lockChanges();
+    this->beginWrite();
     this->value = newValue;
-    this->hasChanged = true;
+    this->endWrite();
+    this->changed();
+    this->unlockChanges();
   }
 
   void setValue(const char *s) {
-    *(this->getValue().string) = s;
-    this->hasChanged = true;
+#if THING_CONCURRENT
+    // Strings are double buffered: the new value is written to the unused
+    // buffer while readers keep copying the current one, then the buffers
+    // are swapped. One string writer at a time.
+    while (__atomic_exchange_n(&this->writingString, 1, __ATOMIC_ACQUIRE)) {
+      thingRelax();
+    }
+    uint32_t target = 1 - this->activeString;
+    while (__atomic_load_n(&this->readers[target], __ATOMIC_SEQ_CST) > 0) {
+      thingRelax();
+    }
+    this->strings[target] = s;
+
+    this->lockChanges();
+    this->beginWrite();
+    __atomic_store_n(&this->activeString, target, __ATOMIC_SEQ_CST);
+    this->value.string = &this->strings[target];
+    this->endWrite();
+    this->changed();
+    this->unlockChanges();
+    __atomic_store_n(&this->writingString, 0, __ATOMIC_RELEASE);
+#else
+    *(this->value.string) = s;
+    this->changed();
+#endif
   }
 
   /**
    * Returns the property value if it has been changed via {@link setValue}
-   * since the last call or returns a nullptr.
+   * since the last call or returns a nullptr. The flag is shared by all
+   * callers; code that observes changes alongside an adapter should use a
+   * {@link ThingChangeCursor} instead.
    */
   ThingDataValue *changedValueOrNull() {
     ThingDataValue *v = this->hasChanged ? &this->value : nullptr;
@@ -242,10 +419,186 @@ public:
     return v;
   }
 
-  ThingDataValue getValue() { return this->value; }
+  /**
+   * Records a new BOOLEAN, NUMBER or INTEGER value from an interrupt
+   * handler. Only byte sized atomic stores are used; the value is set, and
+   * reported like any other change, on the adapter's next update(). Values
+   * recorded before then replace each other. One interrupt handler per
+   * item.
+   */
+  THING_ISR_ATTR void setValueFromISR(ThingDataValue newValue) {
+    uint8_t seq = this->isrSeq;
+    __atomic_store_n(&this->isrSeq, (uint8_t)(seq + 1), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    this->isrValue = newValue;
+    __atomic_store_n(&this->isrSeq, (uint8_t)(seq + 2), __ATOMIC_RELEASE);
+    __atomic_store_n(&this->isrPending, (uint8_t)1, __ATOMIC_RELEASE);
+    __atomic_store_n(&thingISRPending(), (uint8_t)1, __ATOMIC_RELEASE);
+  }
+
+  /**
+   * Sets the value recorded by setValueFromISR(), if there is one. Returns
+   * whether there was.
+   */
+  bool applyValueFromISR() {
+    if (!__atomic_load_n(&this->isrPending, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    // Cleared before reading, so a value recorded meanwhile is not lost
+    __atomic_store_n(&this->isrPending, (uint8_t)0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ThingDataValue v;
+    uint8_t seq;
+    do {
+      seq = __atomic_load_n(&this->isrSeq, __ATOMIC_ACQUIRE);
+      v = this->isrValue;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+             __atomic_load_n(&this->isrSeq, __ATOMIC_RELAXED) != seq);
+    this->setValue(v);
+    return true;
+  }
+
+  /**
+   * Returns the value. With THING_CONCURRENT, this never blocks: reads that
+   * overlap a write are retried. The string a STRING value points to may be
+   * overwritten by the next but one change; getString() returns a copy
+   * that is safe to keep.
+   */
+  ThingDataValue getValue() {
+#if THING_CONCURRENT
+    ThingDataValue v;
+    uint32_t seq;
+    do {
+      seq = __atomic_load_n(&this->seq, __ATOMIC_ACQUIRE);
+      v = this->value;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&this->seq, __ATOMIC_RELAXED) != seq);
+    return v;
+#else
+    return this->value;
+#endif
+  }
+
+  // Returns a copy of a STRING value
+  String getString() {
+#if THING_CONCURRENT
+    for (;;) {
+      uint32_t i = __atomic_load_n(&this->activeString, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&this->readers[i], 1, __ATOMIC_SEQ_CST);
+      // The buffers may have been swapped before the writer could see us
+      if (__atomic_load_n(&this->activeString, __ATOMIC_SEQ_CST) == i) {
+        String copy = this->strings[i];
+        __atomic_sub_fetch(&this->readers[i], 1, __ATOMIC_SEQ_CST);
+        return copy;
+      }
+      __atomic_sub_fetch(&this->readers[i], 1, __ATOMIC_SEQ_CST);
+    }
+#else
+    return *this->value.string;
+#endif
+  }
+
+  /**
+   * Returns the value of {@link thingVersionClock} at the last change, or 0
+   * if the value was never set.
+   */
+  uint32_t getVersion() { return this->version; }
+
+  /**
+   * Backs the value by `getter`, which is called when the value is needed,
+   * e.g. to serialize it, and the last one is older than `ttl` ms. With
+   * `background`, adapters also refresh the value while clients watch the
+   * device, so that changes are pushed. A new value is only reported as a
+   * change if it differs from the cached one.
+   *
+   * The getter runs on the task that needs the value: loop() for update(),
+   * and on ESP32 also the web server task (or the ThingNetworkTask) when a
+   * request reads the value. With THING_CONCURRENT it never runs on two
+   * tasks at the same time; a task that finds it running uses the cached
+   * value instead.
+   */
+  void setGetter(ThingDataValue (*getter_)(), unsigned long ttl_ = 0,
+                 bool background_ = false) {
+    this->getter = getter_;
+    this->ttl = ttl_;
+    this->background = background_;
+    this->fetched = false;
+  }
+
+  /**
+   * Returns the earlier of `deadline` and the time the value is due for a
+   * background refresh.
+   */
+  unsigned long refreshDeadline(unsigned long deadline) {
+    if (this->getter == nullptr || !this->background) {
+      return deadline;
+    }
+    // A refresh in progress sets a new due time when it is done
+    if (!this->lockRefresh()) {
+      return deadline;
+    }
+    unsigned long due =
+        this->fetched ? this->fetchedAt + this->ttl : millis();
+    this->unlockRefresh();
+    return thingEarlier(due, deadline);
+  }
+
+  /**
+   * Calls the getter if the cached value has expired. With `background`,
+   * only if the item asked for background refresh. Returns whether the
+   * getter was called.
+   */
+  bool refresh(bool background = false) {
+    if (this->getter == nullptr || (background && !this->background)) {
+      return false;
+    }
+    if (!this->lockRefresh()) {
+      return false;
+    }
+    unsigned long now = millis();
+    if (this->fetched && now - this->fetchedAt < this->ttl) {
+      this->unlockRefresh();
+      return false;
+    }
+    this->fetched = true;
+    this->fetchedAt = now;
+
+    ThingDataValue newValue = this->getter();
+    if (!this->sameValue(newValue)) {
+      this->setValue(newValue);
+    }
+    this->unlockRefresh();
+    return true;
+  }
+
+  /**
+   * The next item in the owning device's change list, which is ordered by
+   * version, newest first. nullptr at the end of the list.
+   */
+  ThingItem *olderChange() {
+    this->lockChanges();
+    ThingItem *item = this->older;
+    this->unlockChanges();
+    return item;
+  }
+
+  /**
+   * Adds the item to `list`. Called when the item is added to a device.
+   */
+  void trackChanges(ThingChangeList *list) {
+    this->changeList = list;
+    if (this->version > 0) {
+      this->lockChanges();
+      this->link();
+      this->unlockChanges();
+    }
+  }
 
   void serialize(JsonObject obj, String deviceId, String resourceType) {
-    switch (type) {
+    const ThingItem *definition = shared != nullptr ? shared : this;
+    switch (definition->type) {
     case NO_STATE:
       break;
     case BOOLEAN:
@@ -262,36 +615,36 @@ public:
       break;
     }
 
-    if (readOnly) {
+    if (definition->readOnly) {
       obj["readOnly"] = true;
     }
 
-    if (unit != "") {
-      obj["unit"] = unit;
+    if (definition->unit != "") {
+      obj["unit"] = definition->unit;
     }
 
-    if (title != "") {
-      obj["title"] = title;
+    if (definition->title != "") {
+      obj["title"] = definition->title;
     }
 
-    if (description != "") {
-      obj["description"] = description;
+    if (definition->description != "") {
+      obj["description"] = definition->description;
     }
 
-    if (minimum < maximum) {
-      obj["minimum"] = minimum;
+    if (definition->minimum < definition->maximum) {
+      obj["minimum"] = definition->minimum;
     }
 
-    if (maximum > minimum) {
-      obj["maximum"] = maximum;
+    if (definition->maximum > definition->minimum) {
+      obj["maximum"] = definition->maximum;
     }
 
-    if (multipleOf > 0) {
-      obj["multipleOf"] = multipleOf;
+    if (definition->multipleOf > 0) {
+      obj["multipleOf"] = definition->multipleOf;
     }
 
-    if (atType != nullptr) {
-      obj["@type"] = atType;
+    if (definition->atType != nullptr) {
+      obj["@type"] = definition->atType;
     }
 
     // 2.9 Property object: A links array (An array of Link objects linking
@@ -304,6 +657,7 @@ public:
   }
 
   void serializeValue(JsonObject prop) {
+    this->refresh();
     switch (this->type) {
     case NO_STATE:
       break;
@@ -317,7 +671,7 @@ public:
       prop[this->id] = this->getValue().integer;
       break;
     case STRING:
-      prop[this->id] = *this->getValue().string;
+      prop[this->id] = this->getString();
       break;
     }
   }
@@ -325,6 +679,145 @@ public:
 private:
   ThingDataValue value = {false};
   bool hasChanged = false;
+  uint32_t version = 0;
+  // Change list of the owning device, doubly linked so that moving an item
+  // to the front is O(1)
+  ThingChangeList *changeList = nullptr;
+  ThingItem *newer = nullptr;
+  ThingItem *older = nullptr;
+  ThingDataValue (*getter)() = nullptr;
+  unsigned long ttl = 0;
+  unsigned long fetchedAt = 0;
+  bool fetched = false;
+  bool background = false;
+  // Written by setValueFromISR(); isrSeq is odd while a write is in progress
+  ThingDataValue isrValue = {false};
+  uint8_t isrSeq = 0;
+  uint8_t isrPending = 0;
+#if THING_CONCURRENT
+  // Odd while a write is in progress
+  uint32_t seq = 0;
+  String strings[2];
+  uint32_t activeString = 0;
+  // Number of readers copying each string buffer
+  uint32_t readers[2] = {0, 0};
+  uint32_t writingString = 0;
+  // Set while a task calls the getter or reads fetched and fetchedAt
+  uint32_t refreshing = 0;
+#endif
+
+  // Returns false if another task holds the getter and its cache
+  bool lockRefresh() {
+#if THING_CONCURRENT
+    return !__atomic_exchange_n(&this->refreshing, 1, __ATOMIC_ACQUIRE);
+#else
+    return true;
+#endif
+  }
+
+  void unlockRefresh() {
+#if THING_CONCURRENT
+    __atomic_store_n(&this->refreshing, 0, __ATOMIC_RELEASE);
+#endif
+  }
+
+  bool sameValue(ThingDataValue other) {
+    if (this->version == 0) {
+      return false;
+    }
+    ThingDataValue current = this->getValue();
+    switch (this->type) {
+    case BOOLEAN:
+      return current.boolean == other.boolean;
+    case NUMBER:
+      return current.number == other.number;
+    case INTEGER:
+      return current.integer == other.integer;
+    case STRING:
+      // Without THING_CONCURRENT the getter may hand back the very String
+      // the value points to, whose old content is gone
+      return other.string != nullptr && current.string != other.string &&
+             this->getString() == *other.string;
+    default:
+      return true;
+    }
+  }
+
+  // Writers hold the change list lock, which also keeps them from writing
+  // the same item at the same time
+  void lockChanges() {
+#if THING_CONCURRENT
+    if (this->changeList != nullptr) {
+      this->changeList->lock.lock();
+    }
+#endif
+  }
+
+  void unlockChanges() {
+#if THING_CONCURRENT
+    if (this->changeList != nullptr) {
+      this->changeList->lock.unlock();
+    }
+#endif
+  }
+
+  void beginWrite() {
+#if THING_CONCURRENT
+    __atomic_store_n(&this->seq, this->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+  }
+
+  void endWrite() {
+#if THING_CONCURRENT
+    __atomic_store_n(&this->seq, this->seq + 1, __ATOMIC_RELEASE);
+#endif
+  }
+
+  // Called with the change list locked
+  void changed() {
+    this->hasChanged = true;
+    this->version = thingNextVersion();
+    if (this->changeList == nullptr || this->changeList->newest == this) {
+      return;
+    }
+    this->unlink();
+    this->link();
+  }
+
+  void unlink() {
+    if (this->newer != nullptr) {
+      this->newer->older = this->older;
+    } else if (this->changeList->newest == this) {
+      this->changeList->newest = this->older;
+    }
+    if (this->older != nullptr) {
+      this->older->newer = this->newer;
+    }
+    this->newer = nullptr;
+    this->older = nullptr;
+  }
+
+  // Inserts the item by version. Changed items are always the newest, so
+  // this only walks the list for items that changed before being added.
+  void link() {
+    ThingItem *newerItem = nullptr;
+    ThingItem *olderItem = this->changeList->newest;
+    while (olderItem != nullptr && olderItem->version > this->version) {
+      newerItem = olderItem;
+      olderItem = olderItem->older;
+    }
+    this->newer = newerItem;
+    this->older = olderItem;
+    if (olderItem != nullptr) {
+      olderItem->newer = this;
+    }
+    if (newerItem != nullptr) {
+      newerItem->older = this;
+    } else {
+      this->changeList->newest = this;
+    }
+  }
 };
 
 class ThingProperty : public ThingItem {
@@ -342,6 +835,9 @@ public:
   void serialize(JsonObject obj, String deviceId, String resourceType) {
     ThingItem::serialize(obj, deviceId, resourceType);
 
+    const char **propertyEnum =
+        shared != nullptr ? ((const ThingProperty *)shared)->propertyEnum
+                          : this->propertyEnum;
     const char **enumVal = propertyEnum;
     bool hasEnum = propertyEnum != nullptr && *propertyEnum != nullptr;
 
@@ -362,7 +858,6 @@ public:
   }
 };
 
-#ifndef WITHOUT_WS
 class EventSubscription {
 public:
   uint32_t id;
@@ -419,9 +914,6 @@ public:
     return false;
   }
 };
-#else
-using ThingEvent = ThingItem;
-#endif
 
 class ThingEventObject {
 public:
@@ -429,6 +921,8 @@ public:
   ThingDataType type;
   ThingDataValue value = {false};
   String timestamp;
+  // Stamped from thingVersionClock() when the event is queued
+  uint32_t version = 0;
   ThingEventObject *next = nullptr;
 
   ThingEventObject(const char *name_, ThingDataType type_,
@@ -480,23 +974,58 @@ public:
   ThingActionObject *actionQueue = nullptr;
   ThingEvent *firstEvent = nullptr;
   ThingEventObject *eventQueue = nullptr;
+  ThingChangeList changes;
 
   ThingDevice(const char *_id, const char *_title, const char **_type)
       : id(_id), title(_title), type(_type) {}
 
+  // Owns the item arrays
+  ThingDevice(const ThingDevice &) = delete;
+  ThingDevice &operator=(const ThingDevice &) = delete;
+
   ~ThingDevice() {
 #if !defined(WITHOUT_WS) && (defined(ESP8266) || defined(ESP32))
     if (ws)
       delete ws;
 #endif
+    delete[] propertyArray;
+    delete[] actionArray;
+    delete[] eventArray;
   }
 
-#ifndef WITHOUT_WS
+  /**
+   * The properties, actions and events are also kept in arrays, in list
+   * order, and numbered by their index (ThingItem::ordinal). Iterating the
+   * arrays touches one contiguous block instead of following `next`
+   * pointers, and per-item state such as bitmaps can be addressed by
+   * ordinal. The add methods keep the arrays up to date, with room to
+   * grow; freeze() shrinks them to fit. Adapters call it from begin().
+   *
+   * Adding an item renumbers the items of its kind and may move the array,
+   * so on ESP32 add items before begin(), while the web server task does
+   * not read them yet.
+   */
+  void freeze() {
+    shrink(propertyArray, propertyArrayLength, propertyArrayCapacity);
+    shrink(actionArray, actionArrayLength, actionArrayCapacity);
+    shrink(eventArray, eventArrayLength, eventArrayCapacity);
+  }
+
+  uint16_t propertyCount() { return propertyArrayLength; }
+
+  ThingProperty *property(uint16_t ordinal) { return propertyArray[ordinal]; }
+
+  uint16_t actionCount() { return actionArrayLength; }
+
+  ThingAction *action(uint16_t ordinal) { return actionArray[ordinal]; }
+
+  uint16_t eventCount() { return eventArrayLength; }
+
+  ThingEvent *event(uint16_t ordinal) { return eventArray[ordinal]; }
+
   void removeEventSubscriptions(uint32_t id) {
-    ThingEvent *event = firstEvent;
-    while (event != nullptr) {
-      event->removeSubscription(id);
-      event = (ThingEvent *)event->next;
+    for (uint16_t i = 0, n = eventCount(); i < n; i++) {
+      eventArray[i]->removeSubscription(id);
     }
   }
 
@@ -509,6 +1038,7 @@ public:
     event->addSubscription(id);
   }
 
+#ifndef WITHOUT_WS
   void sendActionStatus(ThingActionObject *action) {
     DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
     message["messageType"] = "actionStatus";
@@ -522,11 +1052,9 @@ public:
 #endif
 
   ThingProperty *findProperty(const char *id) {
-    ThingProperty *p = this->firstProperty;
-    while (p) {
-      if (!strcmp(p->id.c_str(), id))
-        return p;
-      p = (ThingProperty *)p->next;
+    for (uint16_t i = 0, n = propertyCount(); i < n; i++) {
+      if (!strcmp(propertyArray[i]->id.c_str(), id))
+        return propertyArray[i];
     }
     return nullptr;
   }
@@ -534,39 +1062,126 @@ public:
   void addProperty(ThingProperty *property) {
     property->next = firstProperty;
     firstProperty = property;
+    property->trackChanges(&changes);
+    insertFront(propertyArray, propertyArrayLength, propertyArrayCapacity,
+                property);
+  }
+
+  /**
+   * Refreshes the properties whose getters asked for background refresh,
+   * see ThingItem::setGetter(). Adapters call this from update() while
+   * clients are watching the device.
+   */
+  void refreshProperties() {
+    for (uint16_t i = 0, n = propertyCount(); i < n; i++) {
+      propertyArray[i]->refresh(true);
+    }
+  }
+
+  /**
+   * Returns the earlier of `deadline` and the next background refresh of
+   * a property.
+   */
+  unsigned long refreshDeadline(unsigned long deadline) {
+    for (uint16_t i = 0, n = propertyCount(); i < n; i++) {
+      deadline = propertyArray[i]->refreshDeadline(deadline);
+    }
+    return deadline;
+  }
+
+  /**
+   * Adds the current value of every property to `prop`.
+   */
+  void serializeValues(JsonObject prop) {
+    for (uint16_t i = 0, n = propertyCount(); i < n; i++) {
+      propertyArray[i]->serializeValue(prop);
+    }
+  }
+
+  /**
+   * Returns the most recently changed property, or nullptr if none has
+   * been set. ThingItem::olderChange() leads to the earlier changes.
+   */
+  ThingItem *lastChangedProperty() {
+#if THING_CONCURRENT
+    changes.lock.lock();
+#endif
+    ThingItem *item = changes.newest;
+#if THING_CONCURRENT
+    changes.lock.unlock();
+#endif
+    return item;
+  }
+
+  /**
+   * Returns the highest version of any of the device's properties.
+   */
+  uint32_t propertiesVersion() {
+    ThingItem *item = lastChangedProperty();
+    return item != nullptr ? item->getVersion() : 0;
   }
 
   ThingAction *findAction(const char *id) {
-    ThingAction *a = this->firstAction;
-    while (a) {
-      if (!strcmp(a->id.c_str(), id))
-        return a;
-      a = (ThingAction *)a->next;
+    for (uint16_t i = 0, n = actionCount(); i < n; i++) {
+      if (!strcmp(actionArray[i]->id.c_str(), id))
+        return actionArray[i];
     }
     return nullptr;
   }
 
   ThingActionObject *findActionObject(const char *id) {
+    lockActions();
     ThingActionObject *a = this->actionQueue;
     while (a) {
       if (!strcmp(a->id.c_str(), id))
-        return a;
+        break;
       a = a->next;
     }
-    return nullptr;
+    unlockActions();
+    return a;
+  }
+
+  /**
+   * Starts the queued action object with the given id, unless it has been
+   * removed. For adapters that start actions on another task than the one
+   * that adds and removes them.
+   */
+  void startActionObject(const char *id) {
+    lockActions();
+    ThingActionObject *obj = this->actionQueue;
+    while (obj != nullptr && strcmp(obj->id.c_str(), id)) {
+      obj = obj->next;
+    }
+    if (obj != nullptr) {
+      obj->starting = true;
+    }
+    unlockActions();
+    if (obj == nullptr) {
+      return;
+    }
+
+    obj->start();
+
+    lockActions();
+    obj->starting = false;
+    bool removed = obj->removed;
+    unlockActions();
+    if (removed) {
+      delete obj->actionRequest;
+      delete obj;
+    }
   }
 
   void addAction(ThingAction *action) {
     action->next = firstAction;
     firstAction = action;
+    insertFront(actionArray, actionArrayLength, actionArrayCapacity, action);
   }
 
   ThingEvent *findEvent(const char *id) {
-    ThingEvent *e = this->firstEvent;
-    while (e) {
-      if (!strcmp(e->id.c_str(), id))
-        return e;
-      e = (ThingEvent *)e->next;
+    for (uint16_t i = 0, n = eventCount(); i < n; i++) {
+      if (!strcmp(eventArray[i]->id.c_str(), id))
+        return eventArray[i];
     }
     return nullptr;
   }
@@ -574,45 +1189,53 @@ public:
   void addEvent(ThingEvent *event) {
     event->next = firstEvent;
     firstEvent = event;
+    insertFront(eventArray, eventArrayLength, eventArrayCapacity, event);
   }
 
-  void setProperty(const char *name, const JsonVariant &newValue) {
+  void setProperty(const char *name, JsonVariantConst newValue) {
+    ThingProperty *property = storeProperty(name, newValue);
+    if (property != nullptr) {
+      property->changed(property->getValue());
+    }
+  }
+
+  /**
+   * Like setProperty(), but leaves calling the property's callback to the
+   * caller. Returns the property, or nullptr if nothing was stored.
+   */
+  ThingProperty *storeProperty(const char *name, JsonVariantConst newValue) {
     ThingProperty *property = findProperty(name);
 
     if (property == nullptr) {
-      return;
+      return nullptr;
     }
 
     switch (property->type) {
-    case NO_STATE: {
-      break;
-    }
+    case NO_STATE:
+      return nullptr;
     case BOOLEAN: {
       ThingDataValue value;
       value.boolean = newValue.as<bool>();
       property->setValue(value);
-      property->changed(value);
       break;
     }
     case NUMBER: {
       ThingDataValue value;
       value.number = newValue.as<double>();
       property->setValue(value);
-      property->changed(value);
       break;
     }
     case INTEGER: {
       ThingDataValue value;
       value.integer = newValue.as<signed long long>();
       property->setValue(value);
-      property->changed(value);
       break;
     }
     case STRING:
       property->setValue(newValue.as<const char *>());
-      property->changed(property->getValue());
       break;
     }
+    return property;
   }
 
   ThingActionObject *requestAction(DynamicJsonDocument *actionRequest) {
@@ -639,39 +1262,50 @@ public:
   }
 
   void removeAction(String id) {
+    lockActions();
     ThingActionObject *curr = actionQueue;
     ThingActionObject *prev = nullptr;
-    while (curr != nullptr) {
-      if (curr->id == id) {
-        if (prev == nullptr) {
-          actionQueue = curr->next;
-        } else {
-          prev->next = curr->next;
-        }
-
-        curr->cancel();
-        delete curr->actionRequest;
-        delete curr;
-        return;
-      }
-
+    while (curr != nullptr && curr->id != id) {
       prev = curr;
       curr = curr->next;
     }
+    bool starting = false;
+    if (curr != nullptr) {
+      if (prev == nullptr) {
+        actionQueue = curr->next;
+      } else {
+        prev->next = curr->next;
+      }
+      starting = curr->starting;
+      curr->removed = true;
+    }
+    unlockActions();
+
+    // An action that is being started is deleted once it returns
+    if (curr == nullptr || starting) {
+      return;
+    }
+    curr->cancel();
+    delete curr->actionRequest;
+    delete curr;
   }
 
   void queueActionObject(ThingActionObject *obj) {
+    lockActions();
     obj->next = actionQueue;
     actionQueue = obj;
+    unlockActions();
   }
 
   void queueEventObject(ThingEventObject *obj) {
+    obj->version = thingNextVersion();
     obj->next = eventQueue;
     eventQueue = obj;
 
 #ifndef WITHOUT_WS
     ThingEvent *event = findEvent(obj->name.c_str());
-    if (!event) {
+    // Adapters without a local WebSocket server send events themselves
+    if (!event || this->ws == nullptr) {
       return;
     }
 
@@ -696,6 +1330,44 @@ public:
   }
 
   void serialize(JsonObject descr, String ip, uint16_t port) {
+    serializeHeader(descr, ip, port);
+
+    uint16_t n = propertyCount();
+    if (n > 0) {
+      JsonObject properties = descr.createNestedObject("properties");
+      for (uint16_t i = 0; i < n; i++) {
+        ThingProperty *property = propertyArray[i];
+        JsonObject obj = properties.createNestedObject(property->id);
+        property->serialize(obj, id, "properties");
+      }
+    }
+
+    n = actionCount();
+    if (n > 0) {
+      JsonObject actions = descr.createNestedObject("actions");
+      for (uint16_t i = 0; i < n; i++) {
+        ThingAction *action = actionArray[i];
+        JsonObject obj = actions.createNestedObject(action->id);
+        action->serialize(obj, id);
+      }
+    }
+
+    n = eventCount();
+    if (n > 0) {
+      JsonObject events = descr.createNestedObject("events");
+      for (uint16_t i = 0; i < n; i++) {
+        ThingEvent *event = eventArray[i];
+        JsonObject obj = events.createNestedObject(event->id);
+        event->serialize(obj, id, "events");
+      }
+    }
+  }
+
+  /**
+   * Serializes the Thing Description without its properties, actions and
+   * events, for adapters that stream those one at a time.
+   */
+  void serializeHeader(JsonObject descr, String ip, uint16_t port) {
     descr["id"] = this->id;
     descr["title"] = this->title;
     descr["@context"] = "https://webthings.io/schemas";
@@ -758,36 +1430,6 @@ public:
       }
     }
 #endif
-
-    ThingProperty *property = this->firstProperty;
-    if (property != nullptr) {
-      JsonObject properties = descr.createNestedObject("properties");
-      while (property != nullptr) {
-        JsonObject obj = properties.createNestedObject(property->id);
-        property->serialize(obj, id, "properties");
-        property = (ThingProperty *)property->next;
-      }
-    }
-
-    ThingAction *action = this->firstAction;
-    if (action != nullptr) {
-      JsonObject actions = descr.createNestedObject("actions");
-      while (action != nullptr) {
-        JsonObject obj = actions.createNestedObject(action->id);
-        action->serialize(obj, id);
-        action = action->next;
-      }
-    }
-
-    ThingEvent *event = this->firstEvent;
-    if (event != nullptr) {
-      JsonObject events = descr.createNestedObject("events");
-      while (event != nullptr) {
-        JsonObject obj = events.createNestedObject(event->id);
-        event->serialize(obj, id, "events");
-        event = (ThingEvent *)event->next;
-      }
-    }
   }
 
   void serializeActionQueue(JsonArray array) {
@@ -829,4 +1471,152 @@ public:
       curr = curr->next;
     }
   }
+
+private:
+#if THING_CONCURRENT
+  // Guards the links of actionQueue
+  ThingSpinLock actionLock;
+#endif
+  ThingProperty **propertyArray = nullptr;
+  ThingAction **actionArray = nullptr;
+  ThingEvent **eventArray = nullptr;
+  uint16_t propertyArrayLength = 0;
+  uint16_t actionArrayLength = 0;
+  uint16_t eventArrayLength = 0;
+  uint16_t propertyArrayCapacity = 0;
+  uint16_t actionArrayCapacity = 0;
+  uint16_t eventArrayCapacity = 0;
+
+  void lockActions() {
+#if THING_CONCURRENT
+    actionLock.lock();
+#endif
+  }
+
+  void unlockActions() {
+#if THING_CONCURRENT
+    actionLock.unlock();
+#endif
+  }
+
+  // Puts `item` first, as the lists do, growing the array if needed
+  template <typename T>
+  static void insertFront(T **&array, uint16_t &length, uint16_t &capacity,
+                          T *item) {
+    if (length == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 4;
+      T **grown = new T *[capacity];
+      for (uint16_t i = 0; i < length; i++) {
+        grown[i + 1] = array[i];
+      }
+      delete[] array;
+      array = grown;
+    } else {
+      for (uint16_t i = length; i > 0; i--) {
+        array[i] = array[i - 1];
+      }
+    }
+    array[0] = item;
+    length++;
+    for (uint16_t i = 0; i < length; i++) {
+      array[i]->ordinal = i;
+    }
+  }
+
+  template <typename T>
+  static void shrink(T **&array, uint16_t length, uint16_t &capacity) {
+    if (length == capacity) {
+      return;
+    }
+    T **fitted = length > 0 ? new T *[length] : nullptr;
+    for (uint16_t i = 0; i < length; i++) {
+      fitted[i] = array[i];
+    }
+    delete[] array;
+    array = fitted;
+    capacity = length;
+  }
+};
+
+/**
+ * Sets the values recorded by ThingItem::setValueFromISR() on the
+ * properties of `firstDevice` and the devices after it. Adapters call this
+ * at the start of update(); it returns right away if no interrupt handler
+ * recorded anything.
+ */
+inline void thingApplyValuesFromISR(ThingDevice *firstDevice) {
+  if (!__atomic_load_n(&thingISRPending(), __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&thingISRPending(), (uint8_t)0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (ThingDevice *device = firstDevice; device != nullptr;
+       device = device->next) {
+    for (uint16_t i = 0, n = device->propertyCount(); i < n; i++) {
+      device->property(i)->applyValueFromISR();
+    }
+  }
+}
+
+/**
+ * Freezes `firstDevice` and the devices after it, see ThingDevice::freeze().
+ */
+inline void thingFreezeDevices(ThingDevice *firstDevice) {
+  for (ThingDevice *device = firstDevice; device != nullptr;
+       device = device->next) {
+    device->freeze();
+  }
+}
+
+/**
+ * One consumer's position in the change history. Each adapter or observer
+ * keeps its own cursor, so all of them see every change no matter who
+ * polls first. Listing the changes of a device takes time proportional to
+ * the number of changed properties, and values are read in place:
+ *
+ *   if (cursor.poll()) {
+ *     for (ThingItem *item = cursor.first(device); item != nullptr;
+ *          item = cursor.next(item)) {
+ *       item->serializeValue(data);
+ *     }
+ *   }
+ */
+class ThingChangeCursor {
+public:
+  // Changes up to this version have been seen. May be moved back to see
+  // changes again, e.g. after a lost connection.
+  uint32_t version = 0;
+
+  /**
+   * Starts a new round if anything changed since the last one and returns
+   * whether it did. first() and next() then list the changes of the round.
+   */
+  bool poll() {
+    if (thingVersionClock() == version) {
+      return false;
+    }
+    previous = version;
+    version = thingVersionClock();
+    return true;
+  }
+
+  // The version the current round started after
+  uint32_t since() const { return previous; }
+
+  // Returns the most recently changed property of `device` in this round
+  ThingItem *first(ThingDevice *device) const {
+    return visible(device->lastChangedProperty());
+  }
+
+  // Returns the next older change after `item` in this round
+  ThingItem *next(ThingItem *item) const {
+    return visible(item->olderChange());
+  }
+
+private:
+  uint32_t previous = 0;
+
+  ThingItem *visible(ThingItem *item) const {
+    return item != nullptr && item->getVersion() > previous ? item : nullptr;
+  }
 };
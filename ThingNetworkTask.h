@@ -0,0 +1,150 @@
+/**
+ * ThingNetworkTask.h
+ *
+ * Runs an adapter on a task of its own, so that serialization, mDNS and
+ * pushing changes to clients do not take time from the sketch. On ESP32 the
+ * task is pinned to the protocol core (core 0) while loop() keeps core 1.
+ *
+ * The two sides only talk through single-producer/single-consumer rings:
+ * property values set by the application are queued and applied on the
+ * network task, and callbacks queued by the adapter run in loop().
+ *
+ *   ThingNetworkTask<WebThingAdapter> network(adapter);
+ *
+ *   void setup() {
+ *     ...
+ *     adapter->begin();
+ *     network.begin();
+ *   }
+ *
+ *   void loop() {
+ *     network.update();
+ *     network.setValue(&temperature, value);
+ *   }
+ *
+ * The adapter has to provide poll(), its network work, and runCallbacks();
+ * of the adapters, only the ESP one does.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#ifndef ESP32
+#error "ThingNetworkTask needs ESP32"
+#endif
+
+#include "Thing.h"
+
+// The network task and loop() share property values
+#if !THING_CONCURRENT
+#error "ThingNetworkTask needs THING_CONCURRENT"
+#endif
+#include "ThingSpscQueue.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Number of property values the application can queue for the network task
+#ifndef THING_NETWORK_QUEUE_DEPTH
+#define THING_NETWORK_QUEUE_DEPTH 16
+#endif
+
+#ifndef THING_NETWORK_CORE
+#define THING_NETWORK_CORE 0
+#endif
+
+#ifndef THING_NETWORK_STACK_SIZE
+#define THING_NETWORK_STACK_SIZE 8192
+#endif
+
+#ifndef THING_NETWORK_PRIORITY
+#define THING_NETWORK_PRIORITY 1
+#endif
+
+// Milliseconds the network task sleeps between two polls
+#ifndef THING_NETWORK_INTERVAL
+#define THING_NETWORK_INTERVAL 1
+#endif
+
+template <typename AdapterT> class ThingNetworkTask {
+public:
+  ThingNetworkTask(AdapterT *adapter_) : adapter(adapter_) {}
+
+  ~ThingNetworkTask() { end(); }
+
+  /**
+   * Starts the network task. Call after the adapter's begin().
+   */
+  void begin() {
+    if (running) {
+      return;
+    }
+    running = true;
+    stopped = false;
+    xTaskCreatePinnedToCore(run, "thing-network", THING_NETWORK_STACK_SIZE,
+                            this, THING_NETWORK_PRIORITY, &task,
+                            THING_NETWORK_CORE);
+  }
+
+  /**
+   * Stops the network task after its current poll.
+   */
+  void end() {
+    if (!running) {
+      return;
+    }
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    // The task deletes itself once it sees the flag
+    while (!__atomic_load_n(&stopped, __ATOMIC_ACQUIRE)) {
+      vTaskDelay(1);
+    }
+  }
+
+  /**
+   * Queues a new value for `item`, which the network task sets before its
+   * next poll. Returns false if the queue is full. Only for BOOLEAN, NUMBER
+   * and INTEGER items; set strings on the item itself. Application side
+   * only.
+   */
+  bool setValue(ThingItem *item, ThingDataValue value) {
+    Update update = {item, value};
+    return updates.push(update);
+  }
+
+  /**
+   * Runs the callbacks the adapter deferred to the application, e.g.
+   * property callbacks and action starts. Call from loop().
+   */
+  void update() { adapter->runCallbacks(); }
+
+private:
+  struct Update {
+    ThingItem *item;
+    ThingDataValue value;
+  };
+
+  AdapterT *adapter;
+  ThingSpscQueue<Update, THING_NETWORK_QUEUE_DEPTH> updates;
+  bool running = false;
+  TaskHandle_t task = nullptr;
+  bool stopped = false;
+
+  static void run(void *arg) {
+    ThingNetworkTask *self = (ThingNetworkTask *)arg;
+    while (__atomic_load_n(&self->running, __ATOMIC_ACQUIRE)) {
+      Update update;
+      while (self->updates.pop(update)) {
+        update.item->setValue(update.value);
+      }
+      self->adapter->poll();
+      // Always sleep for at least a tick so the idle task on this core runs
+      TickType_t ticks = pdMS_TO_TICKS(THING_NETWORK_INTERVAL);
+      vTaskDelay(ticks > 0 ? ticks : 1);
+    }
+    __atomic_store_n(&self->stopped, true, __ATOMIC_RELEASE);
+    vTaskDelete(nullptr);
+  }
+};
@@ -0,0 +1,245 @@
+/**
+ * ThingRouter.h
+ *
+ * Maps request paths of the Web Thing REST API onto devices and their
+ * properties, actions and events. The table is built once from the device
+ * list, after which matching a path allocates nothing.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include "Thing.h"
+
+enum ThingRouteKind {
+  ROUTE_THING,
+  ROUTE_PROPERTIES,
+  ROUTE_PROPERTY,
+  ROUTE_ACTIONS,
+  ROUTE_ACTION,
+  ROUTE_ACTION_ID,
+  ROUTE_EVENTS,
+  ROUTE_EVENT
+};
+
+struct ThingRoute {
+  ThingRouteKind kind;
+  ThingDevice *device;
+  union {
+    ThingProperty *property;
+    ThingAction *action;
+    ThingEvent *event;
+  };
+  // For ROUTE_ACTION_ID: the action id segment of the request path
+  const char *actionId;
+  size_t actionIdLength;
+};
+
+class ThingRouter {
+public:
+  ~ThingRouter() { delete[] routes; }
+
+  /**
+   * (Re)builds the route table. Has to be called again whenever devices or
+   * their properties, actions or events are added.
+   */
+  void build(ThingDevice *firstDevice) {
+    delete[] routes;
+    routes = nullptr;
+    count = 0;
+
+    size_t capacity = 0;
+    for (ThingDevice *device = firstDevice; device != nullptr;
+         device = device->next) {
+      capacity += 4 + device->propertyCount() + device->actionCount() +
+                  device->eventCount();
+    }
+    if (capacity == 0) {
+      return;
+    }
+    routes = new Entry[capacity];
+
+    // Hashes are chained so every key equals the hash of the full path,
+    // e.g. thingHash("/things/lamp/properties/on").
+    for (ThingDevice *device = firstDevice; device != nullptr;
+         device = device->next) {
+      uint32_t base = chain(device->id.c_str(), chain("/things/"));
+      add(base, ROUTE_THING, device, nullptr);
+      add(chain("/properties", base), ROUTE_PROPERTIES, device, nullptr);
+      add(chain("/actions", base), ROUTE_ACTIONS, device, nullptr);
+      add(chain("/events", base), ROUTE_EVENTS, device, nullptr);
+
+      uint32_t propertyBase = chain("/properties/", base);
+      for (uint16_t i = 0; i < device->propertyCount(); i++) {
+        ThingItem *p = device->property(i);
+        add(chain(p->id.c_str(), propertyBase), ROUTE_PROPERTY, device, p);
+      }
+      uint32_t actionBase = chain("/actions/", base);
+      for (uint16_t i = 0; i < device->actionCount(); i++) {
+        ThingAction *a = device->action(i);
+        add(chain(a->id.c_str(), actionBase), ROUTE_ACTION, device, a);
+      }
+      uint32_t eventBase = chain("/events/", base);
+      for (uint16_t i = 0; i < device->eventCount(); i++) {
+        ThingItem *e = device->event(i);
+        add(chain(e->id.c_str(), eventBase), ROUTE_EVENT, device, e);
+      }
+    }
+  }
+
+  /**
+   * Resolves `path` (anything after a '?' is ignored). Runs in time linear
+   * in the length of the path plus a binary search over the table.
+   */
+  bool match(const char *path, ThingRoute &route) const {
+    // Segment boundaries: segment i spans [start[i] + 1, start[i + 1])
+    const size_t maxSegments = 5;
+    size_t start[maxSegments + 1];
+    size_t segments = 0;
+    size_t length = 0;
+    for (; path[length] != '\0' && path[length] != '?'; length++) {
+      if (path[length] == '/') {
+        if (segments == maxSegments) {
+          return false;
+        }
+        start[segments++] = length;
+      }
+    }
+    if (segments < 2 || start[0] != 0) {
+      return false;
+    }
+    start[segments] = length;
+
+    if (!segmentEquals(path, start, 0, "things")) {
+      return false;
+    }
+
+    // At most four segments take part in the lookup; a fifth one can only
+    // be the id of an action request.
+    size_t keySegments = segments < 4 ? segments : 4;
+    uint32_t hash = thingHashBytes(path, start[keySegments]);
+
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (routes[mid].hash < hash) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    for (; lo < count && routes[lo].hash == hash; lo++) {
+      const Entry &entry = routes[lo];
+      if (!verify(entry, path, start, keySegments)) {
+        continue;
+      }
+
+      route.kind = entry.kind;
+      route.device = entry.device;
+      route.property = nullptr;
+      route.actionId = nullptr;
+      route.actionIdLength = 0;
+
+      switch (entry.kind) {
+      case ROUTE_PROPERTY:
+        route.property = (ThingProperty *)entry.item;
+        break;
+      case ROUTE_ACTION:
+        route.action = (ThingAction *)entry.item;
+        break;
+      case ROUTE_EVENT:
+        route.event = (ThingEvent *)entry.item;
+        break;
+      default:
+        break;
+      }
+
+      if (segments == keySegments) {
+        return true;
+      }
+
+      if (entry.kind != ROUTE_ACTION || start[5] - start[4] <= 1) {
+        continue;
+      }
+      route.kind = ROUTE_ACTION_ID;
+      route.actionId = path + start[4] + 1;
+      route.actionIdLength = start[5] - start[4] - 1;
+      return true;
+    }
+
+    return false;
+  }
+
+private:
+  struct Entry {
+    uint32_t hash;
+    ThingRouteKind kind;
+    ThingDevice *device;
+    void *item;
+  };
+
+  Entry *routes = nullptr;
+  size_t count = 0;
+
+  static uint32_t chain(const char *s, uint32_t h = 2166136261UL) {
+    return thingHashBytes(s, strlen(s), h);
+  }
+
+  void add(uint32_t hash, ThingRouteKind kind, ThingDevice *device,
+           void *item) {
+    // Keep the table sorted by hash; this only runs at build time
+    size_t i = count++;
+    while (i > 0 && routes[i - 1].hash > hash) {
+      routes[i] = routes[i - 1];
+      i--;
+    }
+    routes[i].hash = hash;
+    routes[i].kind = kind;
+    routes[i].device = device;
+    routes[i].item = item;
+  }
+
+  static bool segmentEquals(const char *path, const size_t *start, size_t i,
+                            const char *expected) {
+    size_t length = start[i + 1] - start[i] - 1;
+    return strlen(expected) == length &&
+           memcmp(path + start[i] + 1, expected, length) == 0;
+  }
+
+  // Guards against hash collisions by comparing the actual segments
+  static bool verify(const Entry &entry, const char *path, const size_t *start,
+                     size_t segments) {
+    if (!segmentEquals(path, start, 1, entry.device->id.c_str())) {
+      return false;
+    }
+
+    switch (entry.kind) {
+    case ROUTE_THING:
+      return segments == 2;
+    case ROUTE_PROPERTIES:
+      return segments == 3 && segmentEquals(path, start, 2, "properties");
+    case ROUTE_ACTIONS:
+      return segments == 3 && segmentEquals(path, start, 2, "actions");
+    case ROUTE_EVENTS:
+      return segments == 3 && segmentEquals(path, start, 2, "events");
+    case ROUTE_PROPERTY:
+      return segments == 4 && segmentEquals(path, start, 2, "properties") &&
+             segmentEquals(path, start, 3,
+                           ((ThingItem *)entry.item)->id.c_str());
+    case ROUTE_ACTION:
+      return segments == 4 && segmentEquals(path, start, 2, "actions") &&
+             segmentEquals(path, start, 3,
+                           ((ThingAction *)entry.item)->id.c_str());
+    case ROUTE_EVENT:
+      return segments == 4 && segmentEquals(path, start, 2, "events") &&
+             segmentEquals(path, start, 3,
+                           ((ThingItem *)entry.item)->id.c_str());
+    default:
+      return false;
+    }
+  }
+};
@@ -0,0 +1,153 @@
+/**
+ * ThingScheduler.h
+ *
+ * Runs periodic functions, e.g. sensor sampling, from the adapters'
+ * update() instead of timing them with delay() in loop(). Deadlines are
+ * millis() values kept in a min-heap, so finding the next due function
+ * takes constant time and rescheduling one takes logarithmic time.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+// Number of functions that can be scheduled
+#ifndef THING_SCHEDULER_SLOTS
+#ifdef __AVR__
+#define THING_SCHEDULER_SLOTS 4
+#else
+#define THING_SCHEDULER_SLOTS 8
+#endif
+#endif
+
+// Longest time update() lets the sketch sleep, so that adapters that poll
+// the network are still called regularly
+#ifndef THING_MAX_SLEEP
+#define THING_MAX_SLEEP 1000
+#endif
+
+// Returns the earlier of two millis() deadlines, across wrap-around
+inline unsigned long thingEarlier(unsigned long a, unsigned long b) {
+  return (long)(a - b) < 0 ? a : b;
+}
+
+class ThingScheduler {
+public:
+  /**
+   * Calls `fn` every `period` ms, the first time `phase` ms from now.
+   * Returns false if all slots are taken.
+   */
+  bool every(unsigned long period, void (*fn)(), unsigned long phase = 0) {
+    if (count == THING_SCHEDULER_SLOTS || period == 0) {
+      return false;
+    }
+    Task &task = tasks[count];
+    task.fn = fn;
+    task.period = period;
+    task.due = millis() + phase;
+    siftUp(count++);
+    return true;
+  }
+
+  /**
+   * Stops calling `fn`.
+   */
+  void cancel(void (*fn)()) {
+    for (uint8_t i = 0; i < count; i++) {
+      if (tasks[i].fn == fn) {
+        tasks[i] = tasks[--count];
+        if (i < count) {
+          siftDown(i);
+          siftUp(i);
+        }
+        return;
+      }
+    }
+  }
+
+  /**
+   * Returns the earlier of `deadline` and the time the next function is
+   * due.
+   */
+  unsigned long nextDeadline(unsigned long deadline) const {
+    return count > 0 ? thingEarlier(tasks[0].due, deadline) : deadline;
+  }
+
+  /**
+   * Calls the functions that are due. Runs that were missed because the
+   * loop was busy are skipped, so functions stay on their original grid.
+   */
+  void run() {
+    unsigned long now = millis();
+    while (count > 0 && (long)(now - tasks[0].due) >= 0) {
+      Task &task = tasks[0];
+      void (*fn)() = task.fn;
+      do {
+        task.due += task.period;
+      } while ((long)(now - task.due) >= 0);
+      siftDown(0);
+      fn();
+    }
+  }
+
+private:
+  struct Task {
+    void (*fn)();
+    unsigned long period;
+    unsigned long due;
+  };
+
+  Task tasks[THING_SCHEDULER_SLOTS];
+  uint8_t count = 0;
+
+  // Compares deadlines across millis() wrap-around
+  static bool before(const Task &a, const Task &b) {
+    return (long)(a.due - b.due) < 0;
+  }
+
+  void siftUp(uint8_t i) {
+    while (i > 0) {
+      uint8_t parent = (i - 1) / 2;
+      if (!before(tasks[i], tasks[parent])) {
+        break;
+      }
+      Task t = tasks[i];
+      tasks[i] = tasks[parent];
+      tasks[parent] = t;
+      i = parent;
+    }
+  }
+
+  void siftDown(uint8_t i) {
+    for (;;) {
+      uint8_t smallest = i;
+      uint8_t left = 2 * i + 1;
+      uint8_t right = left + 1;
+      if (left < count && before(tasks[left], tasks[smallest])) {
+        smallest = left;
+      }
+      if (right < count && before(tasks[right], tasks[smallest])) {
+        smallest = right;
+      }
+      if (smallest == i) {
+        break;
+      }
+      Task t = tasks[i];
+      tasks[i] = tasks[smallest];
+      tasks[smallest] = t;
+      i = smallest;
+    }
+  }
+};
+
+/**
+ * The scheduler run by every adapter's update().
+ */
+inline ThingScheduler &thingScheduler() {
+  static ThingScheduler scheduler;
+  return scheduler;
+}
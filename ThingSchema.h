@@ -0,0 +1,101 @@
+/**
+ * ThingSchema.h
+ *
+ * Describes a kind of device once, for sketches that expose many identical
+ * devices, e.g. a bridge for a bus of sensors. The property and event
+ * definitions, with their descriptions, units, titles, ranges and @types,
+ * are only kept by the schema. Each device created from it gets full items
+ * of its own, with a copy of the id, but their description strings stay
+ * empty, so they do not allocate them; they serialize the schema's
+ * description under their own device's links.
+ *
+ * Only those strings are saved. Values are not packed into a shared array;
+ * every device is a full ThingDevice with one full item per definition.
+ *
+ * The adapters build their routes in begin(), so create and add all
+ * devices before calling it.
+ *
+ *   ThingSchema sensor(sensorTypes);
+ *   ThingProperty temperature("temperature", "", NUMBER,
+ *                             "TemperatureProperty");
+ *
+ *   void setup() {
+ *     temperature.unit = "degree celsius";
+ *     sensor.addProperty(&temperature);
+ *     for (uint8_t i = 0; i < SENSORS; i++) {
+ *       devices[i] = sensor.create(ids[i], titles[i]);
+ *       adapter->addDevice(devices[i]);
+ *     }
+ *     adapter->begin();
+ *   }
+ *
+ *   devices[i]->property(temperature.ordinal)->setValue(value);
+ *
+ * Items of created devices have the same ordinals as the definitions. They
+ * have no callbacks, as those could not tell the devices apart; observe
+ * them with a ThingChangeCursor instead.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include "Thing.h"
+
+class ThingSchema {
+public:
+  ThingSchema(const char **type) : definitions("", "", type) {}
+
+  /**
+   * Adds a property definition. Its value is not used.
+   */
+  void addProperty(ThingProperty *property) {
+    definitions.addProperty(property);
+  }
+
+  void addEvent(ThingEvent *event) { definitions.addEvent(event); }
+
+  /**
+   * Creates a device with an item for every definition added so far. The
+   * device and its items live for the rest of the program. Call before the
+   * adapter's begin().
+   */
+  ThingDevice *create(const char *id, const char *title) {
+    ThingDevice *device = new ThingDevice(id, title, definitions.type);
+
+    // Devices list their newest item first, so the items are added in
+    // reverse to get the ordinals of the definitions
+    for (uint16_t i = definitions.propertyCount(); i-- > 0;) {
+      ThingProperty *definition = definitions.property(i);
+      ThingProperty *property =
+          new ThingProperty(definition->id.c_str(), "", definition->type, "");
+      property->shared = definition;
+#if !THING_CONCURRENT
+      // Without THING_CONCURRENT, string values live in a String owned by
+      // the sketch
+      if (property->type == STRING) {
+        ThingDataValue value;
+        value.string = new String();
+        property->setValue(value);
+      }
+#endif
+      device->addProperty(property);
+    }
+
+    for (uint16_t i = definitions.eventCount(); i-- > 0;) {
+      ThingEvent *definition = definitions.event(i);
+      ThingEvent *event =
+          new ThingEvent(definition->id.c_str(), "", definition->type, "");
+      event->shared = definition;
+      device->addEvent(event);
+    }
+
+    return device;
+  }
+
+private:
+  // Never added to an adapter; only holds the definitions in order
+  ThingDevice definitions;
+};
@@ -0,0 +1,60 @@
+/**
+ * ThingSpscQueue.h
+ *
+ * Bounded lock-free queue for passing small records from one task to
+ * another, e.g. from the network task to loop(). Exactly one task may push
+ * and exactly one task may pop; neither ever blocks.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <typename T, size_t N> class ThingSpscQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+  /**
+   * Appends `item`. Returns false if the queue is full. Producer only.
+   */
+  bool push(const T &item) {
+    uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == N) {
+      return false;
+    }
+    items[h & (N - 1)] = item;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  /**
+   * Removes the oldest item into `item`. Returns false if the queue is
+   * empty. Consumer only.
+   */
+  bool pop(T &item) {
+    uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&head, __ATOMIC_ACQUIRE) == t) {
+      return false;
+    }
+    item = items[t & (N - 1)];
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  bool empty() const {
+    return __atomic_load_n(&head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+  }
+
+private:
+  T items[N];
+  // Free-running counters; only the producer writes head and only the
+  // consumer writes tail
+  uint32_t head = 0;
+  uint32_t tail = 0;
+};
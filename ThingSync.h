@@ -0,0 +1,66 @@
+/**
+ * ThingSync.h
+ *
+ * Building blocks for property storage that is shared between tasks, e.g.
+ * AsyncWebServer handlers running on the async_tcp task and loop() on
+ * ESP32. Readers never take a lock; writers only hold one for a few
+ * instructions.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+// Makes property values safe to read and write from several tasks. On by
+// default on ESP32, where the web server runs on its own task.
+#ifndef THING_CONCURRENT
+#ifdef ESP32
+#define THING_CONCURRENT 1
+#else
+#define THING_CONCURRENT 0
+#endif
+#endif
+
+#if THING_CONCURRENT
+/**
+ * Lock for sections that only touch a few words of memory. On ESP32 it is
+ * a critical section, so its holder cannot be preempted by a task that
+ * spins on the same core.
+ */
+class ThingSpinLock {
+public:
+  void lock() {
+#ifdef ESP32
+    portENTER_CRITICAL(&mux);
+#else
+    while (__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE)) {
+    }
+#endif
+  }
+
+  void unlock() {
+#ifdef ESP32
+    portEXIT_CRITICAL(&mux);
+#else
+    __atomic_store_n(&locked, 0, __ATOMIC_RELEASE);
+#endif
+  }
+
+private:
+#ifdef ESP32
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+#else
+  uint32_t locked = 0;
+#endif
+};
+
+/**
+ * Gives other tasks, including lower priority ones, the chance to finish
+ * what the caller is waiting for. Must not be used in interrupt handlers.
+ */
+inline void thingRelax() { delay(1); }
+#endif
@@ -0,0 +1,246 @@
+/**
+ * ThingWebSocket.h
+ *
+ * Minimal server-side WebSocket (RFC 6455) support for adapters without an
+ * async WebSocket library: the opening handshake, reading single-frame
+ * messages into a fixed buffer, and writing frame headers.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef WS_FRAME_BUFFER_SIZE
+#define WS_FRAME_BUFFER_SIZE 256
+#endif
+
+enum ThingWebSocketOpcode {
+  WS_OPCODE_CONTINUATION = 0x0,
+  WS_OPCODE_TEXT = 0x1,
+  WS_OPCODE_BINARY = 0x2,
+  WS_OPCODE_CLOSE = 0x8,
+  WS_OPCODE_PING = 0x9,
+  WS_OPCODE_PONG = 0xa
+};
+
+enum ThingWebSocketReadResult { WS_READ_NONE, WS_READ_FRAME, WS_READ_ERROR };
+
+// Close status codes used by the server
+static const uint16_t WS_CLOSE_NORMAL = 1000;
+static const uint16_t WS_CLOSE_PROTOCOL_ERROR = 1002;
+static const uint16_t WS_CLOSE_UNSUPPORTED = 1003;
+static const uint16_t WS_CLOSE_TOO_BIG = 1009;
+
+/**
+ * Computes the Sec-WebSocket-Accept value for a Sec-WebSocket-Key: the
+ * base64 encoded SHA-1 of the key and the protocol GUID. `accept` receives
+ * 28 characters plus the terminating null.
+ */
+inline void thingWebSocketAccept(const char *key, char accept[29]) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  size_t keyLength = strlen(key);
+  size_t length = keyLength + sizeof(guid) - 1;
+
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+
+  // Padded message: data, 0x80, zeros, 64 bit big-endian bit length
+  size_t total = ((length + 8) / 64 + 1) * 64;
+  uint32_t bits = length * 8;
+  for (size_t block = 0; block < total; block += 64) {
+    uint32_t w[16];
+    for (uint8_t i = 0; i < 64; i++) {
+      size_t pos = block + i;
+      uint8_t b;
+      if (pos < keyLength) {
+        b = key[pos];
+      } else if (pos < length) {
+        b = guid[pos - keyLength];
+      } else if (pos == length) {
+        b = 0x80;
+      } else if (pos >= total - 4) {
+        b = bits >> (8 * (total - 1 - pos));
+      } else {
+        b = 0;
+      }
+      if (i % 4 == 0) {
+        w[i / 4] = 0;
+      }
+      w[i / 4] |= (uint32_t)b << (8 * (3 - i % 4));
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (uint8_t t = 0; t < 80; t++) {
+      if (t >= 16) {
+        uint32_t x = w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^
+                     w[t & 15];
+        w[t & 15] = (x << 1) | (x >> 31);
+      }
+
+      uint32_t f, k;
+      if (t < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (t < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (t < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+
+      uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[t & 15];
+      e = d;
+      d = c;
+      c = (b << 30) | (b >> 2);
+      b = a;
+      a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  uint8_t digest[21];
+  for (uint8_t i = 0; i < 20; i++) {
+    digest[i] = h[i / 4] >> (8 * (3 - i % 4));
+  }
+  digest[20] = 0;
+
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for (uint8_t i = 0, o = 0; i < 21; i += 3, o += 4) {
+    uint32_t triple = ((uint32_t)digest[i] << 16) |
+                      ((uint32_t)digest[i + 1] << 8) | digest[i + 2];
+    accept[o] = alphabet[(triple >> 18) & 63];
+    accept[o + 1] = alphabet[(triple >> 12) & 63];
+    accept[o + 2] = alphabet[(triple >> 6) & 63];
+    accept[o + 3] = alphabet[triple & 63];
+  }
+  // 20 bytes encode to 27 characters plus one byte of padding
+  accept[27] = '=';
+  accept[28] = '\0';
+}
+
+/**
+ * Writes the header of an unmasked, unfragmented server frame.
+ */
+inline void thingWebSocketWriteHeader(Print &out, uint8_t opcode,
+                                      size_t length) {
+  out.write((uint8_t)(0x80 | opcode));
+  if (length < 126) {
+    out.write((uint8_t)length);
+  } else if (length <= 0xffff) {
+    out.write((uint8_t)126);
+    out.write((uint8_t)(length >> 8));
+    out.write((uint8_t)(length & 0xff));
+  } else {
+    out.write((uint8_t)127);
+    uint32_t length32 = length;
+    for (int8_t i = 7; i >= 0; i--) {
+      out.write((uint8_t)(i < 4 ? length32 >> (8 * i) : 0));
+    }
+  }
+}
+
+/**
+ * Collects the bytes of incoming client frames. Messages have to fit into
+ * WS_FRAME_BUFFER_SIZE bytes and must not be fragmented.
+ */
+class ThingWebSocketReader {
+public:
+  void reset() {
+    fill = 0;
+    consumed = 0;
+  }
+
+  /**
+   * Reads what `client` has available. On WS_READ_FRAME, `payload` points
+   * to the unmasked payload inside the buffer, which stays valid until the
+   * next call. On WS_READ_ERROR, `closeCode` tells why.
+   */
+  template <typename ClientT>
+  ThingWebSocketReadResult read(ClientT &client, uint8_t &opcode,
+                                char *&payload, size_t &length,
+                                uint16_t &closeCode) {
+    if (consumed > 0) {
+      memmove(buffer, buffer + consumed, fill - consumed);
+      fill -= consumed;
+      consumed = 0;
+    }
+
+    while (fill < WS_FRAME_BUFFER_SIZE && client.available() > 0) {
+      int c = client.read();
+      if (c < 0) {
+        break;
+      }
+      buffer[fill++] = c;
+    }
+
+    if (fill < 2) {
+      return WS_READ_NONE;
+    }
+
+    bool final = buffer[0] & 0x80;
+    opcode = buffer[0] & 0x0f;
+    bool masked = buffer[1] & 0x80;
+    size_t size = buffer[1] & 0x7f;
+    size_t headerSize = 2;
+
+    if (size == 126) {
+      if (fill < 4) {
+        return WS_READ_NONE;
+      }
+      size = ((size_t)buffer[2] << 8) | buffer[3];
+      headerSize = 4;
+    } else if (size == 127) {
+      closeCode = WS_CLOSE_TOO_BIG;
+      return WS_READ_ERROR;
+    }
+
+    // Clients must mask every frame
+    if (!masked) {
+      closeCode = WS_CLOSE_PROTOCOL_ERROR;
+      return WS_READ_ERROR;
+    }
+    if (!final || opcode == WS_OPCODE_CONTINUATION) {
+      closeCode = WS_CLOSE_UNSUPPORTED;
+      return WS_READ_ERROR;
+    }
+
+    headerSize += 4;
+    if (headerSize + size > WS_FRAME_BUFFER_SIZE) {
+      closeCode = WS_CLOSE_TOO_BIG;
+      return WS_READ_ERROR;
+    }
+    if (fill < headerSize + size) {
+      return WS_READ_NONE;
+    }
+
+    const uint8_t *mask = buffer + headerSize - 4;
+    uint8_t *data = buffer + headerSize;
+    for (size_t i = 0; i < size; i++) {
+      data[i] ^= mask[i & 3];
+    }
+
+    payload = (char *)data;
+    length = size;
+    consumed = headerSize + size;
+    return WS_READ_FRAME;
+  }
+
+private:
+  uint8_t buffer[WS_FRAME_BUFFER_SIZE];
+  uint16_t fill = 0;
+  uint16_t consumed = 0;
+};
@@ -0,0 +1,1336 @@
+/**
+ * WebThingAdapterCore.h
+ *
+ * Exposes the Web Thing API based on provided ThingDevices, independent of
+ * the network transport. Boards with a polling Arduino server/client API
+ * (Ethernet, WiFi101, WiFiNINA) instantiate WebThingAdapterCore with their
+ * server, client and UDP types; see EthernetWebThingAdapter.h and
+ * WiFi101WebThingAdapter.h.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifdef CONFIG_MDNS
+#include <ArduinoMDNS.h>
+#endif
+
+#include <ArduinoJson.h>
+
+#define WITHOUT_WS 1
+#include "BufferedPrint.h"
+#include "Thing.h"
+#include "ThingRouter.h"
+#include "ThingWebSocket.h"
+
+#ifndef LARGE_JSON_DOCUMENT_SIZE
+#ifdef LARGE_JSON_BUFFERS
+#define LARGE_JSON_DOCUMENT_SIZE 4096
+#else
+#define LARGE_JSON_DOCUMENT_SIZE 1024
+#endif
+#endif
+
+#ifndef SMALL_JSON_DOCUMENT_SIZE
+#ifdef LARGE_JSON_BUFFERS
+#define SMALL_JSON_DOCUMENT_SIZE 1024
+#else
+#define SMALL_JSON_DOCUMENT_SIZE 256
+#endif
+#endif
+
+// Thing Descriptions are streamed one fragment (the header, or a single
+// property, action or event) at a time; this bounds the size of a fragment.
+#ifndef TD_FRAGMENT_DOCUMENT_SIZE
+#define TD_FRAGMENT_DOCUMENT_SIZE (2 * SMALL_JSON_DOCUMENT_SIZE)
+#endif
+
+// Sockets of the network chip, if known. The Ethernet library cannot tell a
+// W5100, which has 4, from a W5500 at compile time; define THING_W5100 for
+// it.
+#ifndef THING_SOCKETS
+#if defined(THING_W5100)
+#define THING_SOCKETS 4
+#elif defined(MAX_SOCK_NUM)
+#define THING_SOCKETS MAX_SOCK_NUM
+#endif
+#endif
+
+// Number of connections that can wait on
+// GET /things/{id}/properties?wait=<ms>&since=<version> at the same time.
+// Each one keeps a socket open; 0 disables long polling.
+#ifndef LONG_POLL_SLOTS
+#if defined(THING_SOCKETS) && THING_SOCKETS <= 4
+#define LONG_POLL_SLOTS 1
+#else
+#define LONG_POLL_SLOTS 2
+#endif
+#endif
+
+#ifndef LONG_POLL_MAX_WAIT
+#define LONG_POLL_MAX_WAIT 30000
+#endif
+
+// Number of WebSocket connections to ws://<host>/things/{id} that are served
+// at the same time. Each one keeps a socket open and needs a receive buffer
+// of WS_FRAME_BUFFER_SIZE bytes; 0 disables the WebSocket API.
+#ifndef WS_CLIENT_SLOTS
+#if defined(THING_SOCKETS) && THING_SOCKETS <= 4
+#define WS_CLIENT_SLOTS 1
+#else
+#define WS_CLIENT_SLOTS 2
+#endif
+#endif
+
+#ifdef THING_SOCKETS
+// The server needs a socket to listen on and one to answer requests with
+static_assert(LONG_POLL_SLOTS + WS_CLIENT_SLOTS + 2 <= THING_SOCKETS,
+              "LONG_POLL_SLOTS and WS_CLIENT_SLOTS take too many sockets");
+#endif
+
+static const bool DEBUG = false;
+
+enum HTTPMethod {
+  HTTP_ANY,
+  HTTP_GET,
+  HTTP_PUT,
+  HTTP_POST,
+  HTTP_DELETE,
+  HTTP_OPTIONS
+};
+
+enum ReadState {
+  STATE_READ_METHOD,
+  STATE_READ_URI,
+  STATE_DISCARD_HTTP11,
+  STATE_READ_HEADER_NAME,
+  STATE_READ_HEADER_VALUE,
+  STATE_READ_CONTENT
+};
+
+// ServerT and ClientT follow the Arduino EthernetServer/EthernetClient API,
+// UdpT is only needed for mDNS.
+template <typename ServerT, typename ClientT, typename UdpT>
+class WebThingAdapterCore {
+public:
+  WebThingAdapterCore(String _name, uint32_t _ip, uint16_t _port = 80,
+                      bool _disableHostValidation = false)
+      : name(_name), localIP(_ip), port(_port),
+        disableHostValidation(_disableHostValidation), server(_port),
+        response(client)
+#ifdef CONFIG_MDNS
+        ,
+        mdns(udp)
+#endif
+  {
+    ip = "";
+    for (int i = 0; i < 4; i++) {
+      ip += _ip & 0xff;
+      if (i < 3) {
+        ip += '.';
+      }
+      _ip >>= 8;
+    }
+  }
+
+  void begin() {
+    name.toLowerCase();
+#ifdef CONFIG_MDNS
+    String serviceName = name + "._webthing";
+    mdns.begin(localIP, name.c_str());
+    // \x06 is the length of the record
+    mdns.addServiceRecord(serviceName.c_str(), port, MDNSServiceTCP,
+                          "\x06path=/");
+#endif
+    thingFreezeDevices(firstDevice);
+    router.build(firstDevice);
+    server.begin();
+  }
+
+  /**
+   * Does the pending work: timers, long polls, WebSockets and reading the
+   * HTTP request. With a `budget` in microseconds, update() stops once it
+   * is used up and continues where it left off on the next call; the HTTP
+   * request gets what is left of it. Without one, every stage runs once and
+   * one byte of the request is read.
+   *
+   * Returns the millis() time by which update() has to be called again:
+   * now if work is pending, otherwise the next scheduled function, long
+   * poll timeout or background refresh, at most THING_MAX_SLEEP ms ahead.
+   * New connections are no deadline; sleep in a mode the network wakes
+   * the device from.
+   */
+  unsigned long update(unsigned long budget = 0) {
+    unsigned long start = micros();
+    for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+      runStage(stage);
+      stage = (Stage)((stage + 1) % STAGE_COUNT);
+      if (budget > 0 && micros() - start >= budget) {
+        return millis();
+      }
+    }
+    while (budget > 0 && micros() - start < budget && readClient()) {
+    }
+    return nextDeadline();
+  }
+
+  void addDevice(ThingDevice *device) {
+    if (this->lastDevice == nullptr) {
+      this->firstDevice = device;
+      this->lastDevice = device;
+    } else {
+      this->lastDevice->next = device;
+      this->lastDevice = device;
+    }
+  }
+
+private:
+  enum Stage {
+    STAGE_TIMERS,
+    STAGE_LONG_POLLS,
+    STAGE_WEB_SOCKETS,
+    STAGE_CLIENT,
+    STAGE_COUNT
+  };
+
+  // The stage update() starts with, so that it resumes where it ran out of
+  // budget
+  Stage stage = STAGE_TIMERS;
+
+  void runStage(Stage current) {
+    switch (current) {
+    case STAGE_TIMERS:
+      thingApplyValuesFromISR(firstDevice);
+      thingScheduler().run();
+#ifdef CONFIG_MDNS
+      mdns.run();
+#endif
+      break;
+    case STAGE_LONG_POLLS:
+#if LONG_POLL_SLOTS > 0
+      updateLongPolls();
+#endif
+      break;
+    case STAGE_WEB_SOCKETS:
+#if WS_CLIENT_SLOTS > 0
+      updateWebSockets();
+#endif
+      break;
+    case STAGE_CLIENT:
+      readClient();
+      break;
+    default:
+      break;
+    }
+  }
+
+  unsigned long nextDeadline() {
+    unsigned long now = millis();
+    if (client || thingISRPending()) {
+      return now;
+    }
+    unsigned long deadline =
+        thingScheduler().nextDeadline(now + THING_MAX_SLEEP);
+#if LONG_POLL_SLOTS > 0
+    for (LongPoll &poll : longPolls) {
+      if (poll.device != nullptr) {
+        deadline = thingEarlier(poll.start + poll.wait, deadline);
+        deadline = poll.device->refreshDeadline(deadline);
+      }
+    }
+#endif
+#if WS_CLIENT_SLOTS > 0
+    for (WebSocket &ws : webSockets) {
+      if (ws.device == nullptr) {
+        continue;
+      }
+      if (ws.client.available() > 0) {
+        return now;
+      }
+      deadline = ws.device->refreshDeadline(deadline);
+    }
+#endif
+    return deadline;
+  }
+
+  // Reads and handles one byte of the HTTP request. Returns false if there
+  // was nothing to read.
+  bool readClient() {
+    if (!client) {
+      ClientT client = server.available();
+      if (!client) {
+        return false;
+      }
+      if (DEBUG) {
+        Serial.println("New client available");
+      }
+      this->client = client;
+    }
+
+    if (!client.connected()) {
+      if (DEBUG) {
+        Serial.println("Client disconnected");
+      }
+      resetParser();
+      client.stop();
+      return false;
+    }
+
+    char c = client.read();
+    if (c == 255 || c == -1) {
+      if (state == STATE_READ_CONTENT) {
+        handleRequest();
+        resetParser();
+      }
+
+      retries += 1;
+      if (retries > 5000) {
+        if (DEBUG) {
+          Serial.println("Giving up on client");
+        }
+        resetParser();
+        client.stop();
+      }
+      return false;
+    }
+
+    switch (state) {
+    case STATE_READ_METHOD:
+      if (c == ' ') {
+        if (methodRaw == "GET") {
+          method = HTTP_GET;
+        } else if (methodRaw == "POST") {
+          method = HTTP_POST;
+        } else if (methodRaw == "PUT") {
+          method = HTTP_PUT;
+        } else if (methodRaw == "DELETE") {
+          method = HTTP_DELETE;
+        } else if (methodRaw == "OPTIONS") {
+          method = HTTP_OPTIONS;
+        } else {
+          method = HTTP_ANY;
+        }
+        state = STATE_READ_URI;
+      } else {
+        methodRaw += c;
+      }
+      break;
+
+    case STATE_READ_URI:
+      if (c == ' ') {
+        state = STATE_DISCARD_HTTP11;
+      } else {
+        uri += c;
+      }
+      break;
+
+    case STATE_DISCARD_HTTP11:
+      if (c == '\n') {
+        state = STATE_READ_HEADER_NAME;
+      }
+      break;
+
+    case STATE_READ_HEADER_NAME:
+      if (c == '\r') {
+        break;
+      }
+      if (c == '\n') {
+        // An empty line ends the headers
+        if (headerRaw.length() == 0) {
+          state = STATE_READ_CONTENT;
+        }
+        headerRaw = "";
+        break;
+      }
+      if (c == ':') {
+        if (headerRaw.equalsIgnoreCase("Host")) {
+          headerValue = &host;
+#if WS_CLIENT_SLOTS > 0
+        } else if (headerRaw.equalsIgnoreCase("Sec-WebSocket-Key")) {
+          headerValue = &webSocketKey;
+        } else if (headerRaw.equalsIgnoreCase("Sec-WebSocket-Version")) {
+          headerValue = &webSocketVersion;
+        } else if (headerRaw.equalsIgnoreCase("Upgrade")) {
+          headerValue = &upgrade;
+        } else if (headerRaw.equalsIgnoreCase("Connection")) {
+          headerValue = &connection;
+#endif
+        } else {
+          headerValue = nullptr;
+        }
+        headerRaw = "";
+        state = STATE_READ_HEADER_VALUE;
+        break;
+      }
+
+      headerRaw += c;
+      break;
+
+    case STATE_READ_HEADER_VALUE:
+      if (c == '\r' || c == ' ') {
+        break;
+      }
+      if (c == '\n') {
+        state = STATE_READ_HEADER_NAME;
+        break;
+      }
+      if (headerValue != nullptr) {
+        *headerValue += c;
+      }
+      break;
+
+    case STATE_READ_CONTENT:
+      content += c;
+      break;
+    }
+    return true;
+  }
+
+  String name, ip;
+  IPAddress localIP;
+  uint16_t port;
+  bool disableHostValidation;
+  ServerT server;
+  ClientT client;
+  BufferedPrint response;
+#ifdef CONFIG_MDNS
+  // Unused, and may be void, without mDNS
+  UdpT udp;
+  MDNS mdns;
+#endif
+
+  ReadState state = STATE_READ_METHOD;
+  String uri = "";
+  HTTPMethod method = HTTP_ANY;
+  String content = "";
+  String methodRaw = "";
+  String host = "";
+  String headerRaw = "";
+  // Where the value of the header being read goes, if it is of interest
+  String *headerValue = nullptr;
+#if WS_CLIENT_SLOTS > 0
+  String webSocketKey = "";
+  String webSocketVersion = "";
+  String upgrade = "";
+  // Spaces are dropped from header values, e.g. "keep-alive,Upgrade"
+  String connection = "";
+#endif
+  int retries = 0;
+
+  ThingDevice *firstDevice = nullptr, *lastDevice = nullptr;
+  ThingRouter router;
+
+#if LONG_POLL_SLOTS > 0
+  struct LongPoll {
+    ClientT client;
+    ThingDevice *device = nullptr;
+    uint32_t since = 0;
+    unsigned long start = 0;
+    unsigned long wait = 0;
+  };
+
+  LongPoll longPolls[LONG_POLL_SLOTS];
+
+  /**
+   * Takes over the current client until a property of `device` moves past
+   * `since` or `wait` milliseconds have passed. Returns false if all slots
+   * are in use.
+   */
+  bool parkLongPoll(ThingDevice *device, uint32_t since, unsigned long wait) {
+    for (LongPoll &poll : longPolls) {
+      if (poll.device != nullptr) {
+        continue;
+      }
+      poll.client = client;
+      poll.device = device;
+      poll.since = since;
+      poll.start = millis();
+      poll.wait = wait < LONG_POLL_MAX_WAIT ? wait : LONG_POLL_MAX_WAIT;
+      // Detach without closing; update() accepts the next client
+      client = ClientT();
+      return true;
+    }
+    return false;
+  }
+
+  void updateLongPolls() {
+    for (LongPoll &poll : longPolls) {
+      if (poll.device == nullptr) {
+        continue;
+      }
+
+      if (!poll.client.connected()) {
+        poll.client.stop();
+        poll.device = nullptr;
+        continue;
+      }
+
+      poll.device->refreshProperties();
+      if (poll.device->propertiesVersion() <= poll.since &&
+          millis() - poll.start < poll.wait) {
+        continue;
+      }
+
+      response.setOutput(poll.client);
+      sendProperties(poll.device);
+      response.flush();
+      response.setOutput(client);
+      delay(1);
+      poll.client.stop();
+      poll.device = nullptr;
+    }
+  }
+#endif
+
+#if WS_CLIENT_SLOTS > 0
+  struct WebSocket {
+    ClientT client;
+    ThingDevice *device = nullptr;
+    ThingWebSocketReader reader;
+    // Property, action and event changes up to changes.version have been
+    // sent
+    ThingChangeCursor changes;
+  };
+
+  // The event subscription id of a connection is its slot index plus one
+  WebSocket webSockets[WS_CLIENT_SLOTS];
+
+  /**
+   * Completes the opening handshake of a WebSocket request for `device` and
+   * takes over the current client.
+   */
+  void handleWebSocketUpgrade(ThingDevice *device) {
+    connection.toLowerCase();
+    if (!upgrade.equalsIgnoreCase("websocket") ||
+        connection.indexOf("upgrade") < 0) {
+      handleError();
+      return;
+    }
+    if (webSocketVersion != "13") {
+      response.println("HTTP/1.1 426 Upgrade Required");
+      response.println("Sec-WebSocket-Version: 13");
+      sendHeaders();
+      finishResponse();
+      return;
+    }
+
+    for (WebSocket &ws : webSockets) {
+      if (ws.device != nullptr) {
+        continue;
+      }
+
+      char accept[29];
+      thingWebSocketAccept(webSocketKey.c_str(), accept);
+      response.println("HTTP/1.1 101 Switching Protocols");
+      response.println("Upgrade: websocket");
+      response.println("Connection: Upgrade");
+      response.print("Sec-WebSocket-Accept: ");
+      response.println(accept);
+      response.println();
+      response.flush();
+
+      ws.client = client;
+      ws.device = device;
+      ws.reader.reset();
+      ws.changes.version = thingVersionClock();
+      // Detach without closing; update() accepts the next client
+      client = ClientT();
+      return;
+    }
+
+    response.println("HTTP/1.1 503 Service Unavailable");
+    response.println("Connection: close");
+    response.println();
+    finishResponse();
+  }
+
+  void updateWebSockets() {
+    for (uint8_t i = 0; i < WS_CLIENT_SLOTS; i++) {
+      WebSocket &ws = webSockets[i];
+      if (ws.device == nullptr) {
+        continue;
+      }
+
+      if (!ws.client.connected()) {
+        closeWebSocket(i);
+        continue;
+      }
+
+      uint8_t opcode;
+      char *payload;
+      size_t length;
+      uint16_t closeCode;
+      switch (ws.reader.read(ws.client, opcode, payload, length, closeCode)) {
+      case WS_READ_NONE:
+        break;
+      case WS_READ_ERROR:
+        sendWebSocketClose(ws, closeCode);
+        closeWebSocket(i);
+        continue;
+      case WS_READ_FRAME:
+        if (opcode == WS_OPCODE_TEXT) {
+          handleWebSocketMessage(i, payload, length);
+        } else if (opcode == WS_OPCODE_PING) {
+          sendWebSocketFrame(ws, WS_OPCODE_PONG, payload, length);
+        } else if (opcode == WS_OPCODE_CLOSE) {
+          // Echo the status code, if any, and hang up
+          sendWebSocketFrame(ws, WS_OPCODE_CLOSE, payload,
+                             length < 2 ? 0 : 2);
+          closeWebSocket(i);
+          continue;
+        } else if (opcode != WS_OPCODE_PONG) {
+          sendWebSocketClose(ws, WS_CLOSE_UNSUPPORTED);
+          closeWebSocket(i);
+          continue;
+        }
+        break;
+      }
+
+      ws.device->refreshProperties();
+      sendWebSocketChanges(i);
+    }
+  }
+
+  void closeWebSocket(uint8_t i) {
+    WebSocket &ws = webSockets[i];
+    ws.device->removeEventSubscriptions(i + 1);
+    delay(1);
+    ws.client.stop();
+    ws.device = nullptr;
+  }
+
+  void handleWebSocketMessage(uint8_t i, const char *payload, size_t length) {
+    WebSocket &ws = webSockets[i];
+    ThingDevice *device = ws.device;
+
+    // Strings are copied into the document: action requests outlive the
+    // receive buffer
+    DynamicJsonDocument message(SMALL_JSON_DOCUMENT_SIZE);
+    auto error = deserializeJson(message, payload, length);
+    if (error) {
+      sendWebSocketError(ws, message, 400, "Invalid json");
+      return;
+    }
+
+    JsonVariant dataVariant = message["data"];
+    if (!dataVariant.is<JsonObject>()) {
+      sendWebSocketError(ws, message, 400, "data must be an object");
+      return;
+    }
+    JsonObject data = dataVariant.as<JsonObject>();
+
+    const char *messageType = message["messageType"] | "";
+    switch (thingHash(messageType)) {
+    case thingHash("setProperty"):
+      for (JsonPair kv : data) {
+        device->setProperty(kv.key().c_str(), kv.value());
+      }
+      break;
+
+    case thingHash("requestAction"):
+      for (JsonPair kv : data) {
+        DynamicJsonDocument *actionRequest =
+            new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
+
+        JsonObject actionObj = actionRequest->to<JsonObject>();
+        JsonObject nested = actionObj.createNestedObject(kv.key());
+
+        for (JsonPair kvInner : kv.value().as<JsonObject>()) {
+          nested[kvInner.key()] = kvInner.value();
+        }
+
+        ThingActionObject *obj = device->requestAction(actionRequest);
+        if (obj == nullptr) {
+          delete actionRequest;
+          continue;
+        }
+
+        // The status reaches every connection, this one included, through
+        // sendWebSocketChanges()
+        obj->start();
+      }
+      break;
+
+    case thingHash("addEventSubscription"):
+      for (JsonPair kv : data) {
+        ThingEvent *event = device->findEvent(kv.key().c_str());
+        if (event && !event->isSubscribed(i + 1)) {
+          event->addSubscription(i + 1);
+        }
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  /**
+   * Sends what changed on the device since the last call: one
+   * propertyStatus message for all changed properties, an actionStatus
+   * message per updated action and an event message per new subscribed
+   * event.
+   */
+  void sendWebSocketChanges(uint8_t i) {
+    WebSocket &ws = webSockets[i];
+    if (!ws.changes.poll()) {
+      return;
+    }
+    uint32_t since = ws.changes.since();
+
+    ThingDevice *device = ws.device;
+    ThingItem *item = ws.changes.first(device);
+    if (item != nullptr) {
+      DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
+      message["messageType"] = "propertyStatus";
+      JsonObject prop = message.createNestedObject("data");
+      while (item != nullptr) {
+        item->serializeValue(prop);
+        item = ws.changes.next(item);
+      }
+      sendWebSocketDocument(ws, message);
+    }
+
+    ThingActionObject *action = device->actionQueue;
+    while (action != nullptr) {
+      if (action->version > since) {
+        sendWebSocketActionStatus(ws, action);
+      }
+      action = action->next;
+    }
+
+    sendWebSocketEvents(i, device->eventQueue, since);
+  }
+
+  // The event queue is newest first; recurse to send the oldest first
+  void sendWebSocketEvents(uint8_t i, ThingEventObject *obj, uint32_t since) {
+    if (obj == nullptr || obj->version <= since) {
+      return;
+    }
+    sendWebSocketEvents(i, obj->next, since);
+
+    WebSocket &ws = webSockets[i];
+    ThingEvent *event = ws.device->findEvent(obj->name.c_str());
+    if (event == nullptr || !event->isSubscribed(i + 1)) {
+      return;
+    }
+
+    DynamicJsonDocument message(SMALL_JSON_DOCUMENT_SIZE);
+    message["messageType"] = "event";
+    JsonObject data = message.createNestedObject("data");
+    obj->serialize(data);
+    sendWebSocketDocument(ws, message);
+  }
+
+  void sendWebSocketActionStatus(WebSocket &ws, ThingActionObject *action) {
+    DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
+    message["messageType"] = "actionStatus";
+    JsonObject data = message.createNestedObject("data");
+    action->serialize(data, ws.device->id);
+    sendWebSocketDocument(ws, message);
+  }
+
+  void sendWebSocketError(WebSocket &ws, JsonDocument &message, int status,
+                          const char *msg) {
+    message.clear();
+    message["error"] = msg;
+    message["status"] = status;
+    sendWebSocketDocument(ws, message);
+  }
+
+  void sendWebSocketDocument(WebSocket &ws, JsonDocument &message) {
+    response.setOutput(ws.client);
+    thingWebSocketWriteHeader(response, WS_OPCODE_TEXT, measureJson(message));
+    serializeJson(message, response);
+    response.flush();
+    response.setOutput(client);
+  }
+
+  void sendWebSocketFrame(WebSocket &ws, uint8_t opcode, const char *payload,
+                          size_t length) {
+    response.setOutput(ws.client);
+    thingWebSocketWriteHeader(response, opcode, length);
+    response.write((const uint8_t *)payload, length);
+    response.flush();
+    response.setOutput(client);
+  }
+
+  void sendWebSocketClose(WebSocket &ws, uint16_t code) {
+    char payload[2] = {(char)(code >> 8), (char)(code & 0xff)};
+    sendWebSocketFrame(ws, WS_OPCODE_CLOSE, payload, 2);
+  }
+#endif
+
+  /**
+   * Looks up `name` in the query string of the current request.
+   */
+  bool queryParam(const char *name, unsigned long &value) {
+    size_t nameLength = strlen(name);
+    const char *param = strchr(uri.c_str(), '?');
+    while (param != nullptr) {
+      param++;
+      if (strncmp(param, name, nameLength) == 0 && param[nameLength] == '=') {
+        value = strtoul(param + nameLength + 1, nullptr, 10);
+        return true;
+      }
+      param = strchr(param, '&');
+    }
+    return false;
+  }
+
+  bool verifyHost() {
+    if (disableHostValidation) {
+      return true;
+    }
+
+    int colonIndex = host.indexOf(':');
+    if (colonIndex >= 0) {
+      host.remove(colonIndex);
+    }
+    if (host.equalsIgnoreCase(name + ".local")) {
+      return true;
+    }
+    if (host == ip) {
+      return true;
+    }
+    if (host == "localhost") {
+      return true;
+    }
+    return false;
+  }
+
+  void handleRequest() {
+    if (DEBUG) {
+      Serial.print("handleRequest: ");
+      Serial.print("method: ");
+      Serial.println(method);
+      Serial.print("uri: ");
+      Serial.println(uri);
+      Serial.print("host: ");
+      Serial.println(host);
+      Serial.print("content: ");
+      Serial.println(content);
+    }
+
+    if (!verifyHost()) {
+      response.println("HTTP/1.1 403 Forbidden");
+      response.println("Connection: close");
+      response.println();
+      finishResponse();
+      return;
+    }
+
+    if (uri == "/") {
+      handleThings();
+      return;
+    }
+
+    ThingRoute route;
+    if (!router.match(uri.c_str(), route)) {
+      handleError();
+      return;
+    }
+
+    switch (route.kind) {
+    case ROUTE_THING:
+#if WS_CLIENT_SLOTS > 0
+      if (method == HTTP_GET && webSocketKey.length() > 0) {
+        handleWebSocketUpgrade(route.device);
+        break;
+      }
+#endif
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThing(route.device);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_PROPERTIES:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingPropertiesGet(route.device);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_PROPERTY:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingPropertyGet(route.property);
+      } else if (method == HTTP_PUT) {
+        handleThingPropertyPut(route.device, route.property);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_ACTIONS:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingActionsGet(route.device);
+      } else if (method == HTTP_POST) {
+        handleThingActionsPost(route.device);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_ACTION:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingActionGet(route.device, route.action);
+      } else if (method == HTTP_POST) {
+        handleThingActionPost(route.device, route.action);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_ACTION_ID:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingActionIdGet(route.device, route);
+      } else if (method == HTTP_DELETE) {
+        handleThingActionIdDelete(route.device, route);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_EVENTS:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingEventsGet(route.device);
+      } else {
+        handleError();
+      }
+      break;
+    case ROUTE_EVENT:
+      if (method == HTTP_GET || method == HTTP_OPTIONS) {
+        handleThingEventGet(route.device, route.event);
+      } else {
+        handleError();
+      }
+      break;
+    }
+  }
+
+  void sendOk() { response.println("HTTP/1.1 200 OK"); }
+
+  void sendCreated() { response.println("HTTP/1.1 201 Created"); }
+
+  void sendNoContent() { response.println("HTTP/1.1 204 No Content"); }
+
+  void sendHeaders(bool chunked = false) {
+    response.println("Access-Control-Allow-Origin: *");
+    response.println(
+        "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS");
+    response.println("Access-Control-Allow-Headers: "
+                     "Origin, X-Requested-With, Content-Type, Accept");
+    response.println("Content-Type: application/json");
+    if (chunked) {
+      response.println("Transfer-Encoding: chunked");
+    }
+    response.println("Connection: close");
+    response.println();
+  }
+
+  // Status line, headers and body all go through the response buffer, so
+  // most replies leave in a single write.
+  void finishResponse() {
+    response.flush();
+    delay(1);
+    client.stop();
+  }
+
+  void handleThings() {
+    sendOk();
+    sendHeaders(true);
+    response.beginChunked();
+
+    DynamicJsonDocument buf(TD_FRAGMENT_DOCUMENT_SIZE);
+    response.print('[');
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      if (device != this->firstDevice) {
+        response.print(',');
+      }
+      streamThing(buf, device, true);
+      device = device->next;
+    }
+    response.print(']');
+
+    response.endChunked();
+    finishResponse();
+  }
+
+  void handleThing(ThingDevice *device) {
+    sendOk();
+    sendHeaders(true);
+    response.beginChunked();
+
+    DynamicJsonDocument buf(TD_FRAGMENT_DOCUMENT_SIZE);
+    streamThing(buf, device, false);
+
+    response.endChunked();
+    finishResponse();
+  }
+
+  /**
+   * Writes the Thing Description of `device` to the response, serializing
+   * one fragment at a time into `buf` so that its size does not limit the
+   * size of the description.
+   */
+  void streamThing(JsonDocument &buf, ThingDevice *device, bool withHref) {
+    buf.clear();
+    JsonObject descr = buf.to<JsonObject>();
+    device->serializeHeader(descr, ip, port);
+    if (withHref) {
+      descr["href"] = "/things/" + device->id;
+    }
+#if WS_CLIENT_SLOTS > 0
+    {
+      JsonObject links_prop = descr["links"].createNestedObject();
+      links_prop["rel"] = "alternate";
+
+      if (port != 80) {
+        char buffer[33];
+        itoa(port, buffer, 10);
+        links_prop["href"] =
+            "ws://" + ip + ":" + buffer + "/things/" + device->id;
+      } else {
+        links_prop["href"] = "ws://" + ip + "/things/" + device->id;
+      }
+    }
+#endif
+
+    // Copy the header members so the object can be kept open
+    response.print('{');
+    bool first = true;
+    for (JsonPair kv : descr) {
+      if (!first) {
+        response.print(',');
+      }
+      first = false;
+      printKey(kv.key().c_str());
+      serializeJson(kv.value(), response);
+    }
+
+    uint16_t n = device->propertyCount();
+    if (n > 0) {
+      response.print(',');
+      printKey("properties");
+      response.print('{');
+      for (uint16_t i = 0; i < n; i++) {
+        ThingProperty *property = device->property(i);
+        if (i > 0) {
+          response.print(',');
+        }
+        printKey(property->id.c_str());
+        buf.clear();
+        JsonObject obj = buf.to<JsonObject>();
+        property->serialize(obj, device->id, "properties");
+        serializeJson(obj, response);
+      }
+      response.print('}');
+    }
+
+    n = device->actionCount();
+    if (n > 0) {
+      response.print(',');
+      printKey("actions");
+      response.print('{');
+      for (uint16_t i = 0; i < n; i++) {
+        ThingAction *action = device->action(i);
+        if (i > 0) {
+          response.print(',');
+        }
+        printKey(action->id.c_str());
+        buf.clear();
+        JsonObject obj = buf.to<JsonObject>();
+        action->serialize(obj, device->id);
+        serializeJson(obj, response);
+      }
+      response.print('}');
+    }
+
+    n = device->eventCount();
+    if (n > 0) {
+      response.print(',');
+      printKey("events");
+      response.print('{');
+      for (uint16_t i = 0; i < n; i++) {
+        ThingEvent *event = device->event(i);
+        if (i > 0) {
+          response.print(',');
+        }
+        printKey(event->id.c_str());
+        buf.clear();
+        JsonObject obj = buf.to<JsonObject>();
+        event->serialize(obj, device->id, "events");
+        serializeJson(obj, response);
+      }
+      response.print('}');
+    }
+
+    response.print('}');
+  }
+
+  // Writes `"key":`, escaping the key as a JSON string
+  void printKey(const char *key) {
+    response.print('"');
+    for (; *key != '\0'; key++) {
+      char c = *key;
+      if (c == '"' || c == '\\') {
+        response.print('\\');
+        response.print(c);
+      } else if ((uint8_t)c < 0x20) {
+        static const char hex[] = "0123456789abcdef";
+        response.print("\\u00");
+        response.print(hex[c >> 4]);
+        response.print(hex[c & 0xf]);
+      } else {
+        response.print(c);
+      }
+    }
+    response.print("\":");
+  }
+
+  void handleThingPropertyGet(ThingItem *item) {
+    sendOk();
+    sendHeaders();
+
+    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
+    JsonObject prop = doc.to<JsonObject>();
+    item->serializeValue(prop);
+    serializeJson(prop, response);
+    finishResponse();
+  }
+
+  void handleThingActionGet(ThingDevice *device, ThingAction *action) {
+    sendOk();
+    sendHeaders();
+
+    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    JsonArray queue = doc.to<JsonArray>();
+    device->serializeActionQueue(queue, action->id);
+    serializeJson(queue, response);
+    finishResponse();
+  }
+
+  void handleThingActionIdGet(ThingDevice *device, const ThingRoute &route) {
+    size_t offset = route.actionId - uri.c_str();
+    String actionId = uri.substring(offset, offset + route.actionIdLength);
+
+    ThingActionObject *obj = device->findActionObject(actionId.c_str());
+    if (obj == nullptr) {
+      handleError();
+      return;
+    }
+
+    sendOk();
+    sendHeaders();
+
+    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
+    JsonObject o = doc.to<JsonObject>();
+    obj->serialize(o, device->id);
+    serializeJson(o, response);
+    finishResponse();
+  }
+
+  void handleThingActionIdDelete(ThingDevice *device,
+                                 const ThingRoute &route) {
+    size_t offset = route.actionId - uri.c_str();
+    String actionId = uri.substring(offset, offset + route.actionIdLength);
+
+    device->removeAction(actionId);
+    sendNoContent();
+    sendHeaders();
+    finishResponse();
+  }
+
+  void handleThingActionPost(ThingDevice *device, ThingAction *action) {
+    DynamicJsonDocument *newBuffer =
+        new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
+    auto error = deserializeJson(*newBuffer, content);
+    if (error) { // unable to parse json
+      handleError();
+      delete newBuffer;
+      return;
+    }
+
+    JsonObject newAction = newBuffer->as<JsonObject>();
+
+    if (!newAction.containsKey(action->id)) {
+      handleError();
+      delete newBuffer;
+      return;
+    }
+
+    ThingActionObject *obj = device->requestAction(newBuffer);
+
+    if (obj == nullptr) {
+      handleError();
+      delete newBuffer;
+      return;
+    }
+
+    sendCreated();
+    sendHeaders();
+
+    DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    JsonObject item = respBuffer.to<JsonObject>();
+    obj->serialize(item, device->id);
+    serializeJson(item, response);
+    finishResponse();
+
+    obj->start();
+  }
+
+  void handleThingEventGet(ThingDevice *device, ThingItem *item) {
+    sendOk();
+    sendHeaders();
+
+    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
+    JsonArray queue = doc.to<JsonArray>();
+    device->serializeEventQueue(queue, item->id);
+    serializeJson(queue, response);
+    finishResponse();
+  }
+
+  void handleThingPropertiesGet(ThingDevice *device) {
+#if LONG_POLL_SLOTS > 0
+    // ?wait=<ms>&since=<version> holds the request until a property changes
+    // past `since` (default: the current version) or the wait times out.
+    unsigned long wait = 0;
+    if (method == HTTP_GET && queryParam("wait", wait) && wait > 0) {
+      unsigned long since = device->propertiesVersion();
+      queryParam("since", since);
+      if (device->propertiesVersion() <= since &&
+          parkLongPoll(device, since, wait)) {
+        return;
+      }
+    }
+#endif
+
+    sendProperties(device);
+    finishResponse();
+  }
+
+  // The version header is what clients pass back as `since` when polling
+  void sendProperties(ThingDevice *device) {
+    sendOk();
+    response.print("X-Property-Version: ");
+    response.println(device->propertiesVersion());
+    // Browsers only let scripts read listed headers of CORS responses
+    response.println("Access-Control-Expose-Headers: X-Property-Version");
+    sendHeaders();
+
+    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    JsonObject prop = doc.to<JsonObject>();
+    device->serializeValues(prop);
+    serializeJson(prop, response);
+  }
+
+  void handleThingActionsGet(ThingDevice *device) {
+    sendOk();
+    sendHeaders();
+
+    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    JsonArray queue = doc.to<JsonArray>();
+    device->serializeActionQueue(queue);
+    serializeJson(queue, response);
+    finishResponse();
+  }
+
+  void handleThingActionsPost(ThingDevice *device) {
+    DynamicJsonDocument *newBuffer =
+        new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
+    auto error = deserializeJson(*newBuffer, content);
+    if (error) { // unable to parse json
+      handleError();
+      delete newBuffer;
+      return;
+    }
+
+    JsonObject newAction = newBuffer->as<JsonObject>();
+
+    if (newAction.size() != 1) {
+      handleError();
+      delete newBuffer;
+      return;
+    }
+
+    ThingActionObject *obj = device->requestAction(newBuffer);
+
+    if (obj == nullptr) {
+      handleError();
+      delete newBuffer;
+      return;
+    }
+
+    sendCreated();
+    sendHeaders();
+
+    DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    JsonObject item = respBuffer.to<JsonObject>();
+    obj->serialize(item, device->id);
+    serializeJson(item, response);
+    finishResponse();
+
+    obj->start();
+  }
+
+  void handleThingEventsGet(ThingDevice *device) {
+    sendOk();
+    sendHeaders();
+
+    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    JsonArray queue = doc.to<JsonArray>();
+    device->serializeEventQueue(queue);
+    serializeJson(queue, response);
+    finishResponse();
+  }
+
+  void handleThingPropertyPut(ThingDevice *device, ThingProperty *property) {
+    DynamicJsonDocument newBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    auto error = deserializeJson(newBuffer, content);
+    if (error) { // unable to parse json
+      handleError();
+      return;
+    }
+    JsonObject newProp = newBuffer.as<JsonObject>();
+
+    if (!newProp.containsKey(property->id)) {
+      handleError();
+      return;
+    }
+
+    device->setProperty(property->id.c_str(), newProp[property->id]);
+
+    sendOk();
+    sendHeaders();
+
+    serializeJson(newProp, response);
+    finishResponse();
+  }
+
+  void handleError() {
+    response.println("HTTP/1.1 400 Bad Request");
+    sendHeaders();
+    finishResponse();
+  }
+
+  void resetParser() {
+    state = STATE_READ_METHOD;
+    method = HTTP_ANY;
+    methodRaw = "";
+    headerRaw = "";
+    headerValue = nullptr;
+    host = "";
+#if WS_CLIENT_SLOTS > 0
+    webSocketKey = "";
+    webSocketVersion = "";
+    upgrade = "";
+    connection = "";
+#endif
+    uri = "";
+    content = "";
+    retries = 0;
+  }
+};
@@ -149,9 +149,9 @@ void setup() {
   weather.addProperty(&weatherHum);
   adapter->addDevice(&weather);
   adapter->begin();
-}
 
-void loop() {
-  readBME280Data();
-  adapter->update();
+  // Sample the sensor every two seconds from adapter->update()
+  thingScheduler().every(2000, readBME280Data);
 }
+
+void loop() { adapter->update(); }
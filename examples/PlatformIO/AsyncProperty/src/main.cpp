@@ -94,7 +94,4 @@ void setup() {
   adapter->begin();
 }
 
-void loop() {
-  delay(500);
-  adapter->update();
-}
+void loop() { adapter->update(); }
@@ -22,6 +22,26 @@ const int sensorPin = A0;
 
 double lastValue = 0;
 
+// Only called when a client reads the level, or at most once a second
+// while clients are watching the device. Changes below 1% keep the last
+// value, so they are not pushed to clients.
+ThingPropertyValue readLevel() {
+  const int threshold = 1;
+  int value = analogRead(sensorPin);
+  double percent = (double)100. - (value / 1024. * 100.);
+  if (abs(percent - lastValue) >= threshold) {
+    Serial.print("log: Value: ");
+    Serial.print(value);
+    Serial.print(" = ");
+    Serial.print(percent);
+    Serial.println("%");
+    lastValue = percent;
+  }
+  ThingPropertyValue levelValue;
+  levelValue.number = lastValue;
+  return levelValue;
+}
+
 int setupNetwork() {
   Serial.println(__FUNCTION__);
   // TODO: update with actual MAC address
@@ -47,6 +67,7 @@ void setup(void) {
   delay(3000);
   adapter = new WebThingAdapter("analog-sensor", ip);
   property.unit = "percent";
+  property.setGetter(readLevel, 1000, true);
   device.addProperty(&property);
   adapter->addDevice(&device);
   Serial.println("Starting HTTP server");
@@ -57,20 +78,4 @@ void setup(void) {
   Serial.println(device.id);
 }
 
-void loop(void) {
-  const int threshold = 1;
-  int value = analogRead(sensorPin);
-  double percent = (double)100. - (value / 1024. * 100.);
-  if (abs(percent - lastValue) >= threshold) {
-    Serial.print("log: Value: ");
-    Serial.print(value);
-    Serial.print(" = ");
-    Serial.print(percent);
-    Serial.println("%");
-    ThingPropertyValue levelValue;
-    levelValue.number = percent;
-    property.setValue(levelValue);
-    lastValue = percent;
-  }
-  adapter->update();
-}
+void loop(void) { adapter->update(); }
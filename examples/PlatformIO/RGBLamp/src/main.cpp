@@ -148,7 +148,8 @@ void loop(void) {
 
   bool on = deviceOn.getValue().boolean;
   int level = deviceLevel.getValue().number;
-  update(&lastColor, on ? level : 0);
+  String color = deviceColor.getString();
+  update(&color, on ? level : 0);
 
   if (on != lastOn) {
     Serial.print(device.id);
@@ -157,7 +158,7 @@ void loop(void) {
     Serial.print(", level: ");
     Serial.print(level);
     Serial.print(", color: ");
-    Serial.println(lastColor);
+    Serial.println(color);
   }
   lastOn = on;
 }
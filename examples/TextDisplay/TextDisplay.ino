@@ -122,5 +122,5 @@ void setup() {
 
 void loop() {
   adapter->update();
-  displayString(lastText);
+  displayString(text.getString());
 }